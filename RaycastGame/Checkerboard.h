@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CHECKERBOARD_SSE2
+#endif
+
+// Reconstruction for checkerboard rendering, on packed 24-bit RGB rows.
+//
+// A checkerboard frame shades every other pixel of each row, offset by one on
+// alternate rows, and swaps the two sets the next frame. Pixels not shaded
+// this frame are filled from a history buffer holding the ones shaded last
+// frame. The four shaded neighbours of each filled pixel are on the rows
+// above and below and either side of it on its own row.
+//
+// The SSE2 path works on 16 bytes at a time regardless of pixel boundaries and
+// keeps only the bytes of unshaded pixels. Without SSE2 the scalar loop gives
+// the same result.
+
+namespace checkerboard {
+
+enum Fill {
+	// Take the history pixel as it is, for a camera that has not moved.
+	FILL_KEEP,
+	// Clamp the history pixel to the range of its shaded neighbours, per
+	// channel, so a camera that moved does not leave ghosts behind.
+	FILL_CLAMP,
+	// Average the shaded neighbours, when there is no usable history.
+	FILL_AVERAGE,
+};
+
+inline uint8_t avg(int a, int b) {
+	return (uint8_t)((a + b + 1) >> 1);
+}
+
+// Byte b of a row: either saved to hist if its pixel was shaded (pixel x with
+// x % 2 == shaded), or filled in.
+inline void reconstructByte(uint8_t* row, const uint8_t* up, const uint8_t* down, uint8_t* hist, int width, int shaded, Fill fill, int b) {
+	int x = b / 3;
+	if ((x & 1) == shaded) {
+		hist[b] = row[b];
+		return;
+	}
+
+	// At the ends of the row the missing neighbour is replaced by the other.
+	uint8_t l = row[x > 0 ? b - 3 : b + 3];
+	uint8_t r = row[x < width - 1 ? b + 3 : b - 3];
+	uint8_t u = up[b];
+	uint8_t d = down[b];
+	if (fill == FILL_KEEP) {
+		row[b] = hist[b];
+	}
+	else if (fill == FILL_CLAMP) {
+		uint8_t lo = l < r ? l : r;
+		uint8_t hi = l < r ? r : l;
+		lo = u < lo ? u : lo;
+		hi = u > hi ? u : hi;
+		lo = d < lo ? d : lo;
+		hi = d > hi ? d : hi;
+		uint8_t h = hist[b];
+		row[b] = h < lo ? lo : h > hi ? hi : h;
+	}
+	else {
+		row[b] = avg(avg(l, r), avg(u, d));
+	}
+}
+
+// Reconstructs one row of width pixels. up and down are the rows either side
+// (the other one at the top and bottom of the image); width must be at least 2.
+inline void reconstructRow(uint8_t* row, const uint8_t* up, const uint8_t* down, uint8_t* hist, int width, int shaded, Fill fill) {
+	int n = width * 3;
+	int b = 0;
+	// The first pixel has no left neighbour.
+	for (; b < 3 && b < n; b++) reconstructByte(row, up, down, hist, width, shaded, fill, b);
+
+#ifdef CHECKERBOARD_SSE2
+	// Chunks start at byte 3 + 16k, so the pixel pattern under them repeats
+	// every three chunks.
+	__m128i masks[3];
+	for (int k = 0; k < 3; k++) {
+		uint8_t bytes[16];
+		for (int j = 0; j < 16; j++) bytes[j] = ((3 + 16 * k + j) / 3 & 1) != shaded ? 0xff : 0;
+		masks[k] = _mm_loadu_si128((const __m128i*)bytes);
+	}
+
+	// The left neighbours overlap the chunk just stored, so they are shifted
+	// in from the chunk before in registers rather than loaded again, which
+	// would stall on store forwarding. prev starts with the first pixel.
+	__m128i prev = _mm_slli_si128(_mm_cvtsi32_si128(row[0] | row[1] << 8 | row[2] << 16), 13);
+
+	// Stop while the right neighbours of the whole chunk are still in the row.
+	for (int k = 0; b + 19 <= n; b += 16, k = k == 2 ? 0 : k + 1) {
+		__m128i c = _mm_loadu_si128((const __m128i*)(row + b));
+		__m128i h = _mm_loadu_si128((const __m128i*)(hist + b));
+		__m128i l = _mm_or_si128(_mm_slli_si128(c, 3), _mm_srli_si128(prev, 13));
+		prev = c;
+		__m128i r = _mm_loadu_si128((const __m128i*)(row + b + 3));
+		__m128i u = _mm_loadu_si128((const __m128i*)(up + b));
+		__m128i d = _mm_loadu_si128((const __m128i*)(down + b));
+
+		__m128i v;
+		if (fill == FILL_KEEP) {
+			v = h;
+		}
+		else if (fill == FILL_CLAMP) {
+			__m128i lo = _mm_min_epu8(_mm_min_epu8(l, r), _mm_min_epu8(u, d));
+			__m128i hi = _mm_max_epu8(_mm_max_epu8(l, r), _mm_max_epu8(u, d));
+			v = _mm_min_epu8(_mm_max_epu8(h, lo), hi);
+		}
+		else {
+			v = _mm_avg_epu8(_mm_avg_epu8(l, r), _mm_avg_epu8(u, d));
+		}
+
+		__m128i m = masks[k];
+		_mm_storeu_si128((__m128i*)(row + b), _mm_or_si128(_mm_and_si128(m, v), _mm_andnot_si128(m, c)));
+		_mm_storeu_si128((__m128i*)(hist + b), _mm_or_si128(_mm_and_si128(m, h), _mm_andnot_si128(m, c)));
+	}
+#endif
+
+	for (; b < n; b++) reconstructByte(row, up, down, hist, width, shaded, fill, b);
+}
+
+}
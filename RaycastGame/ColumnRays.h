@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define COLUMNRAYS_SSE
+#endif
+
+// The ray through each screen column, for a camera looking along dir with
+// right = (-dir.y, dir.x).
+//
+// In camera space column x looks along ahead + across[x] * right, with across
+// running evenly from -u at the left edge to u at the right, where
+// u = 2 tan(fovX / 2). That table only changes with the FOV or the width, so
+// it is kept between frames. Each frame it is rotated into world directions
+// dirX/dirY in one pass. Every entry is computed directly from its column, so
+// nothing drifts across the screen the way stepping from one column to the
+// next does.
+//
+// project() is the inverse, mapping camera-space points back to columns, so
+// walls and sprites agree on where things are on screen.
+
+class ColumnRays {
+public:
+	// Rebuilds the camera-space table if fovX or width changed, then rotates it
+	// to face (dx, dy).
+	void setView(float fovX, int width, float dx, float dy) {
+		if (fovX != tableFov || width != (int)across.size()) {
+			tableFov = fovX;
+			u = tanf(fovX / 2) * 2;
+			scale = width / (2 * u);
+			across.resize(width);
+			for (int x = 0; x < width; x++) across[x] = u * (2.0f * x / width - 1);
+			dirX.resize(width);
+			dirY.resize(width);
+		}
+
+		int x = 0;
+#ifdef COLUMNRAYS_SSE
+		__m128 vx = _mm_set1_ps(dx);
+		__m128 vy = _mm_set1_ps(dy);
+		for (; x + 4 <= width; x += 4) {
+			__m128 a = _mm_loadu_ps(&across[x]);
+			_mm_storeu_ps(&dirX[x], _mm_sub_ps(vx, _mm_mul_ps(a, vy)));
+			_mm_storeu_ps(&dirY[x], _mm_add_ps(vy, _mm_mul_ps(a, vx)));
+		}
+#endif
+		for (; x < width; x++) {
+			dirX[x] = dx - across[x] * dy;
+			dirY[x] = dy + across[x] * dx;
+		}
+	}
+
+	int width() const {
+		return (int)across.size();
+	}
+
+	// Screen x of a camera-space point `side` to the right and `ahead` in front.
+	float project(float side, float ahead) const {
+		return (width() / 2) + side / ahead * scale;
+	}
+
+	// Half-width of the view plane one unit in front of the camera.
+	float u = 0;
+	// Columns per unit of across.
+	float scale = 0;
+
+	std::vector<float> across;
+	// World direction of each column's ray for the last setView.
+	std::vector<float> dirX;
+	std::vector<float> dirY;
+
+private:
+	float tableFov = -1;
+};
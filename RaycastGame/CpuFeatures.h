@@ -0,0 +1,37 @@
+#pragma once
+
+// Run-time checks for instruction sets newer than the build targets.
+//
+// Neither the x64 project nor a default GCC or Clang build assumes more than
+// SSE2, so kernels that need SSSE3 are compiled separately and picked when
+// the CPU has it. MSVC accepts any intrinsic in any function; GCC and Clang
+// need the function marked with CPU_TARGET_SSSE3, and the mark is not
+// inherited by lambdas inside it.
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CPU_X86
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include <tmmintrin.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CPU_TARGET_SSSE3 __attribute__((target("ssse3")))
+#else
+#define CPU_TARGET_SSSE3
+#endif
+
+inline bool cpuHasSsse3() {
+	static const bool has = [] {
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 9)) != 0;
+#else
+		return __builtin_cpu_supports("ssse3") != 0;
+#endif
+	}();
+	return has;
+}
+#endif
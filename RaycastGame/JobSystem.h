@@ -0,0 +1,264 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Trace.h"
+
+// A small work-stealing job scheduler.
+//
+// Work is described as a JobGraph: jobs are added on one thread together with
+// the jobs they depend on, then the whole graph is handed to JobSystem::run,
+// which blocks until every job has finished. The calling thread helps execute
+// jobs while it waits, so a JobSystem with zero workers still works (it just
+// runs everything inline).
+//
+// Each worker owns a queue. Jobs made ready by a worker are pushed to the back
+// of its own queue and popped from the back (LIFO, cache friendly); idle
+// workers steal from the front of other queues. Jobs submitted from outside
+// the pool go to a shared injection queue.
+//
+// Scheduling order is not deterministic, so jobs that run concurrently must
+// write to disjoint data. Ordering between jobs is expressed only through
+// dependencies.
+
+class JobGraph;
+
+struct Job {
+	const char* name = nullptr;
+	std::function<void()> fn;
+	std::atomic<int> pendingDeps{ 0 };
+	std::vector<Job*> dependents;
+	JobGraph* graph = nullptr;
+};
+
+class JobGraph {
+public:
+	typedef Job* Handle;
+
+	// name labels the job in traces and must outlive the graph.
+	Handle add(const char* name, std::function<void()> fn, std::initializer_list<Handle> deps = {}) {
+		Job* job = newJob(name, std::move(fn));
+		for (Handle dep : deps) {
+			if (dep == nullptr) continue;
+			dep->dependents.push_back(job);
+			job->pendingDeps++;
+		}
+		return job;
+	}
+
+	// Splits [0, count) into chunks of at most grain items and adds one job per
+	// chunk. Returns a join job that finishes once every chunk has run, so later
+	// jobs can depend on the whole loop.
+	Handle parallelFor(const char* name, int count, int grain, std::function<void(int, int)> fn, std::initializer_list<Handle> deps = {}) {
+		if (grain < 1) grain = 1;
+		Handle join = newJob(name, nullptr);
+		auto body = std::make_shared<std::function<void(int, int)>>(std::move(fn));
+		for (int begin = 0; begin < count; begin += grain) {
+			int end = begin + grain < count ? begin + grain : count;
+			Handle chunk = add(name, [body, begin, end] { (*body)(begin, end); }, deps);
+			chunk->dependents.push_back(join);
+			join->pendingDeps++;
+		}
+		if (count <= 0) {
+			for (Handle dep : deps) {
+				if (dep == nullptr) continue;
+				dep->dependents.push_back(join);
+				join->pendingDeps++;
+			}
+		}
+		return join;
+	}
+
+	bool empty() const {
+		return jobs.empty();
+	}
+
+	void clear() {
+		jobs.clear();
+	}
+
+private:
+	friend class JobSystem;
+
+	Job* newJob(const char* name, std::function<void()> fn) {
+		jobs.emplace_back();
+		Job* job = &jobs.back();
+		job->name = name;
+		job->fn = std::move(fn);
+		job->graph = this;
+		return job;
+	}
+
+	// std::deque never moves its elements on emplace_back, so Job pointers stay
+	// valid while the graph is being built.
+	std::deque<Job> jobs;
+	std::atomic<int> remaining{ 0 };
+};
+
+class JobSystem {
+public:
+	// numWorkers < 0 picks one worker per hardware thread, minus the caller.
+	explicit JobSystem(int numWorkers = -1) {
+		if (numWorkers < 0) {
+			numWorkers = (int)std::thread::hardware_concurrency() - 1;
+			if (numWorkers < 0) numWorkers = 0;
+		}
+		queues.resize(numWorkers + 1);
+		for (auto& q : queues) q = std::make_unique<Queue>();
+		for (int i = 0; i < numWorkers; i++) {
+			threads.emplace_back([this, i] { workerLoop(i); });
+		}
+	}
+
+	~JobSystem() {
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			quit = true;
+		}
+		sleepCv.notify_all();
+		for (auto& t : threads) t.join();
+	}
+
+	JobSystem(const JobSystem&) = delete;
+	JobSystem& operator=(const JobSystem&) = delete;
+
+	int numWorkers() const {
+		return (int)threads.size();
+	}
+
+	// Executes every job in the graph and clears it. Safe to call from several
+	// threads at once with different graphs.
+	void run(JobGraph& graph) {
+		if (graph.empty()) return;
+
+		// Collect roots before pushing any: once a root runs, its dependents
+		// start reaching zero pending deps and must not be pushed twice.
+		std::vector<Job*> roots;
+		for (Job& job : graph.jobs) {
+			if (job.pendingDeps == 0) roots.push_back(&job);
+		}
+
+		graph.remaining = (int)graph.jobs.size();
+		for (Job* job : roots) push(job);
+
+		while (graph.remaining > 0) {
+			Job* job = pop();
+			if (job) {
+				execute(job);
+			}
+			else {
+				std::this_thread::yield();
+			}
+		}
+
+		graph.clear();
+	}
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Job*> jobs;
+	};
+
+	// Index into queues of the calling thread; external threads use the shared
+	// injection queue, which is the last one.
+	int localQueue() const {
+		int index = workerIndex();
+		return index >= 0 ? index : (int)queues.size() - 1;
+	}
+
+	void push(Job* job) {
+		Queue& q = *queues[localQueue()];
+		{
+			std::lock_guard<std::mutex> lock(q.mutex);
+			q.jobs.push_back(job);
+		}
+		queued++;
+		{
+			// Taking the lock orders this push against a worker that has just
+			// found nothing to do and is about to sleep.
+			std::lock_guard<std::mutex> lock(sleepMutex);
+		}
+		sleepCv.notify_one();
+	}
+
+	Job* pop() {
+		int self = localQueue();
+		Job* job = nullptr;
+
+		{
+			Queue& q = *queues[self];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			if (!q.jobs.empty()) {
+				job = q.jobs.back();
+				q.jobs.pop_back();
+			}
+		}
+
+		int n = (int)queues.size();
+		for (int i = 1; job == nullptr && i <= n; i++) {
+			Queue& q = *queues[(self + i) % n];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			if (!q.jobs.empty()) {
+				job = q.jobs.front();
+				q.jobs.pop_front();
+			}
+		}
+
+		if (job) queued--;
+		return job;
+	}
+
+	void execute(Job* job) {
+		if (job->fn) {
+			TRACE_SCOPE(job->name);
+			job->fn();
+		}
+
+		for (Job* dependent : job->dependents) {
+			if (--dependent->pendingDeps == 0) push(dependent);
+		}
+
+		// Must be the last access to the job: once remaining reaches zero the
+		// thread waiting in run() may clear the graph.
+		job->graph->remaining--;
+	}
+
+	void workerLoop(int index) {
+		workerIndex() = index;
+		trace::setThreadName("worker " + std::to_string(index + 1));
+		while (true) {
+			Job* job = pop();
+			if (job) {
+				execute(job);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			sleepCv.wait(lock, [this] { return quit || queued > 0; });
+			if (quit) return;
+		}
+	}
+
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> threads;
+
+	std::atomic<int> queued{ 0 };
+	std::mutex sleepMutex;
+	std::condition_variable sleepCv;
+	bool quit = false;
+
+	static int& workerIndex() {
+		static thread_local int index = -1;
+		return index;
+	}
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#ifdef __linux__
+#include <cerrno>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware performance counters for the calling thread, read through Linux
+// perf_event_open. Cycles, instructions, cache misses and branch misses are
+// opened as one group so they are always scheduled together and their ratios
+// are meaningful.
+//
+// Counts are cumulative since the group was opened; take a sample before and
+// after the code of interest and subtract. Only user-space events are counted,
+// which keeps this working at the default perf_event_paranoid level.
+//
+// On other platforms, or when the kernel refuses (no PMU in a VM, paranoid
+// too high), available() is false and samples read as zero.
+
+enum PerfEvent {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_BRANCH_MISSES,
+	numPerfEvents
+};
+
+const char* const perfEventNames[numPerfEvents] = { "cycles", "instructions", "cacheMisses", "branchMisses" };
+
+struct PerfSample {
+	uint64_t count[numPerfEvents];
+
+	PerfSample operator-(const PerfSample& o) const {
+		PerfSample d;
+		for (int i = 0; i < numPerfEvents; i++) d.count[i] = count[i] - o.count[i];
+		return d;
+	}
+};
+
+class PerfCounters {
+public:
+	PerfCounters() {
+#ifdef __linux__
+		const uint64_t configs[numPerfEvents] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_BRANCH_MISSES,
+		};
+		for (int i = 0; i < numPerfEvents; i++) {
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = configs[i];
+			attr.read_format = PERF_FORMAT_GROUP;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+
+			int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0);
+			if (fd < 0) {
+				error = std::string("perf_event_open(") + perfEventNames[i] + "): " + strerror(errno);
+				close();
+				return;
+			}
+			fds[i] = fd;
+		}
+#else
+		error = "hardware counters are only supported on Linux";
+#endif
+	}
+
+	~PerfCounters() {
+		close();
+	}
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	bool available() const {
+		return fds[0] >= 0;
+	}
+
+	// Why the counters could not be opened.
+	const std::string& lastError() const {
+		return error;
+	}
+
+	PerfSample read() const {
+		PerfSample s = {};
+#ifdef __linux__
+		if (!available()) return s;
+
+		// PERF_FORMAT_GROUP layout: number of events, then one value each.
+		uint64_t buf[1 + numPerfEvents];
+		if (::read(fds[0], buf, sizeof(buf)) == (ssize_t)sizeof(buf) && buf[0] == numPerfEvents) {
+			for (int i = 0; i < numPerfEvents; i++) s.count[i] = buf[1 + i];
+		}
+#endif
+		return s;
+	}
+
+private:
+	void close() {
+#ifdef __linux__
+		for (int i = numPerfEvents - 1; i >= 0; i--) {
+			if (fds[i] >= 0) ::close(fds[i]);
+			fds[i] = -1;
+		}
+#endif
+	}
+
+	int fds[numPerfEvents] = { -1, -1, -1, -1 };
+	std::string error;
+};
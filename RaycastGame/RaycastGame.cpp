@@ -1,11 +1,23 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
 #include <vector>
 #include <memory>
 #include <stdexcept>
 #include <cstdint>
+#include <cstring>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <algorithm>
+#include <climits>
+#include <cctype>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
 
 #define SDL_MAIN_HANDLED
 #include <SDL2/SDL.h>
@@ -13,14 +25,30 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#include "Checkerboard.h"
+#include "ColumnRays.h"
+#include "JobSystem.h"
+#include "PerfCounters.h"
+#include "TextureAtlas.h"
+#include "Trace.h"
+#include "TripleBuffer.h"
+#include "Upscale.h"
+#include "VideoCapture.h"
+
 using namespace std;
 
-const int width = 640;
-const int height = 360;
+// Size of the window's back buffer. Frames are drawn at the internal render
+// resolution and scaled to this.
+const int windowWidth = 640;
+const int windowHeight = 360;
 
 const int FPS = 60;
 const float dt = 1.0f / FPS;
 
+// Most ticks Window::run will simulate to catch up in one frame. Past that the
+// game slows down rather than spending ever longer catching up.
+const int maxTicksPerFrame = 5;
+
 template <class T>
 T sdl_e(T x) {
 	if (x != 0) {
@@ -63,6 +91,10 @@ float lerp(float a, float b, float t) {
 	return a + t * (b - a);
 }
 
+vec2 lerp(vec2 a, vec2 b, float t) {
+	return { lerp(a.x, b.x, t), lerp(a.y, b.y, t) };
+}
+
 int min(int a, int b) {
 	return a < b ? a : b;
 }
@@ -71,16 +103,344 @@ int max(int a, int b) {
 	return a > b ? a : b;
 }
 
-const int pixelPitch = width * sizeof(RGB);
-const size_t pixelBufSize = width * height * sizeof(RGB);
+uint64_t fnv1a(uint64_t h, const void* data, size_t size) {
+	const uint8_t* p = (const uint8_t*)data;
+	for (size_t i = 0; i < size; i++) {
+		h = (h ^ p[i]) * 0x100000001b3ull;
+	}
+	return h;
+}
+
+const uint64_t fnvBasis = 0xcbf29ce484222325ull;
+
+struct Raycast {
+	vec2 o;
+	vec2 d;
+};
+
+struct RaycastResult {
+	vec2i tile;
+	float t;
+	int side;
+};
+
 
 class Window;
 
+bool moveCircle(vec2& p, vec2 delta, float r, vec2* hitNormal = nullptr, float feetZ = 0);
+float floorHeight(vec2 p);
+float ceilingHeight(vec2 p);
+
 class Sprite {
 public:
 	vec2 pos;
 };
 
+class Entity {
+public:
+	vec2 pos;
+	vec2 vel;
+	float radius;
+
+	// Position after the movement phase, before collision resolves it.
+	vec2 next;
+	// Position before the last tick, for drawing between ticks.
+	vec2 prev;
+
+	// Per-entity random state so AI decisions do not depend on which worker
+	// runs the entity or in which order.
+	uint32_t rng;
+
+	bool seesPlayer;
+};
+
+struct LosQuery {
+	vec2 from;
+	vec2 to;
+};
+
+// Line of sight queries against the tile grid. Results are cached until the
+// next call to newTick, so systems asking about the same pair of points in one
+// tick only pay for the first query.
+class LineOfSight {
+public:
+	void newTick();
+
+	bool query(vec2 from, vec2 to);
+
+	// Answers count queries, writing 1 (visible) or 0 to results. Queries not
+	// in the cache are traced on the job pool.
+	void queryBatch(const LosQuery* queries, uint8_t* results, int count, JobSystem& jobs);
+
+	int cacheHits = 0;
+	int cacheMisses = 0;
+
+private:
+	struct Entry {
+		uint32_t key[4];
+		uint32_t generation;
+		bool pending;
+		uint8_t visible;
+	};
+
+	Entry* find(const LosQuery& q, bool& found);
+	void reserve(int count);
+
+	vector<Entry> table;
+	int used = 0;
+	uint32_t generation = 1;
+
+	vector<int> misses;
+	vector<int> repeats;
+	vector<Entry*> slots;
+	JobGraph graph;
+};
+
+// Distance-to-target field over the tile grid that agents follow downhill.
+// When the target moves, only cells whose distance actually changes are
+// visited again (an incremental Dijkstra in the style of LPA*: each cell keeps
+// its current distance g and a one-step lookahead rhs, and only cells where
+// the two disagree are queued). Moves are 8-connected with integer costs and
+// may not cut wall corners.
+class FlowField {
+public:
+	// Moves the target to the tile containing p (world units).
+	void setTarget(vec2 p);
+
+	// Cost to reach the target from the tile, or flowUnreachable.
+	int distance(int x, int y) const;
+
+	// Unit vector from p towards the centre of the next tile on the way to the
+	// target, or {0, 0} if p is on the target or cannot reach it.
+	vec2 direction(vec2 p) const;
+
+	// Cells processed by the last setTarget.
+	int lastUpdated = 0;
+
+private:
+	void resize();
+	int calcRhs(int c) const;
+	void updateCell(int c);
+	void push(int c);
+	void computeDistances();
+
+	template <class F>
+	void forEachNeighbour(int c, F f) const;
+
+	int size = 0;
+	int target = -1;
+	vector<int> g;
+	vector<int> rhs;
+	vector<uint8_t> moves;
+	vector<vector<int>> buckets;
+	int current = 0;
+};
+
+// Tile-to-tile potentially visible set, built once when the map loads. Each
+// open tile has a bitset row with a bit per tile that can be seen from
+// somewhere inside it, so culling an object is one bit test.
+class PotentiallyVisibleSet {
+public:
+	// Walls lower than eyeZ do not block sight, as they can be seen over from
+	// any eye up to that height.
+	void build(JobSystem& jobs, float eyeZ);
+
+	// As given to build. Views from higher up must not be culled with the set.
+	float eyeZ = 0;
+
+	// Row for the tile containing p, or nullptr if p is not in an open tile
+	// (callers should then treat everything as visible).
+	const uint64_t* row(vec2 p) const;
+
+	// Whether the tile containing p is set in row. A null row sees everything.
+	bool visible(const uint64_t* row, vec2 p) const;
+
+	// Whether any tile touched by the box of half-size r around p is set in row.
+	bool visible(const uint64_t* row, vec2 p, float r) const;
+
+private:
+	int tileAt(vec2 p) const;
+	// Makes every row symmetric with its column.
+	void mirror();
+
+	int tiles = 0;
+	int rowWords = 0;
+	vector<uint64_t> bits;
+	JobGraph graph;
+};
+
+// Camera pose at a point in time along a scripted camera path. Positions are in
+// tiles and angles in degrees, as written in level files.
+struct CameraKey {
+	float time;
+	vec2 pos;
+	float angle;
+	float fov;
+	float z;
+};
+
+struct Level {
+	string name;
+	int size;
+	vector<uint8_t> tiles;
+	// Height of the wall on each tile.
+	vector<uint8_t> heights;
+	// Floor and ceiling heights of each open tile. A ceiling of 0 leaves the
+	// tile open to the sky.
+	vector<uint8_t> floors;
+	vector<uint8_t> ceilings;
+	vec2 spawn;
+	float spawnAngle;
+	vector<Sprite> sprites;
+	vector<CameraKey> path;
+};
+
+Level defaultLevel();
+Level loadLevel(const char* path);
+
+// Tiles of the level being played, size by size.
+vector<uint8_t> map;
+int mapSize = 0;
+// Wall heights of the same tiles, and floor and ceiling heights of the open
+// ones (ceiling 0 for open sky).
+vector<uint8_t> mapHeights;
+vector<uint8_t> mapFloors;
+vector<uint8_t> mapCeilings;
+// Whether any floor is off the ground or any tile has a ceiling. Maps without
+// sectors have one floor plane at z = 0 and are drawn the simpler way.
+bool mapHasSectors = false;
+// Lowest floor and highest wall, floor or ceiling on the map.
+float mapBottomZ = 0;
+float mapTopZ = 0;
+
+void useLevelMap(const Level& l);
+// Sets mapHasSectors, mapBottomZ and mapTopZ from the map arrays.
+void measureMap();
+
+// Keys the simulation reads, in bit order of InputFrame::keys.
+const int inputKeys[] = {
+	SDL_SCANCODE_W, SDL_SCANCODE_S, SDL_SCANCODE_A, SDL_SCANCODE_D,
+	SDL_SCANCODE_LEFT, SDL_SCANCODE_RIGHT, SDL_SCANCODE_SPACE,
+	SDL_SCANCODE_I, SDL_SCANCODE_K,
+};
+const int numInputKeys = sizeof(inputKeys) / sizeof(inputKeys[0]);
+
+// Everything Game::update reads from the player for one tick.
+struct InputFrame {
+	uint16_t keys;
+	int16_t mouseRelX;
+
+	bool keyDown(int key) const;
+};
+
+// Input files are a small header followed by one 4 byte record per tick:
+// the key bits and the mouse delta, both little-endian 16 bit.
+class InputRecorder {
+public:
+	explicit InputRecorder(const char* path);
+	void write(const InputFrame& in);
+
+private:
+	ofstream file;
+};
+
+class InputReplay {
+public:
+	explicit InputReplay(const char* path);
+	bool read(InputFrame& in);
+
+private:
+	ifstream file;
+};
+
+enum RenderStage {
+	STAGE_FLOOR,
+	STAGE_WALLS,
+	STAGE_RECONSTRUCT,
+	STAGE_SPRITES,
+	numRenderStages
+};
+
+const char* const renderStageNames[numRenderStages] = { "floor", "walls", "reconstruct", "sprites" };
+
+// Set by --perf when the hardware counters could be opened. Game::draw and the
+// benchmarks only sample them while this is non-null. The counters only count
+// the main thread that opened them, so this is only set for --bench and
+// --microbench, which draw on that thread; a windowed run draws on the render
+// thread.
+PerfCounters* perfCounters = nullptr;
+
+// Everything the render passes read that changes while the game runs, taken
+// after the simulation ticks. The render thread only ever sees snapshots,
+// never the live Game state.
+struct FrameSnapshot {
+	uint32_t tick;
+	vec2 pos;
+	float angle;
+	vec2 dir;
+	float camZ;
+	float fovX;
+	float camDist;
+	float invCamDist;
+	// Internal render resolution.
+	int width;
+	int height;
+	// Sprites and entities in the camera's PVS.
+	vector<Sprite> sprites;
+};
+
+// Hash of the camera and projection of a snapshot, which decide where every
+// floor and wall pixel lands.
+uint64_t viewCameraHash(const FrameSnapshot& f) {
+	uint64_t h = fnvBasis;
+	h = fnv1a(h, &f.pos, sizeof(f.pos));
+	h = fnv1a(h, &f.angle, sizeof(f.angle));
+	h = fnv1a(h, &f.dir, sizeof(f.dir));
+	h = fnv1a(h, &f.camZ, sizeof(f.camZ));
+	h = fnv1a(h, &f.fovX, sizeof(f.fovX));
+	h = fnv1a(h, &f.camDist, sizeof(f.camDist));
+	h = fnv1a(h, &f.invCamDist, sizeof(f.invCamDist));
+	h = fnv1a(h, &f.width, sizeof(f.width));
+	return fnv1a(h, &f.height, sizeof(f.height));
+}
+
+// Hash of everything in a snapshot that affects the image, which is all of it
+// but the tick. Two snapshots with the same hash render the same pixels.
+uint64_t viewHash(const FrameSnapshot& f) {
+	return fnv1a(viewCameraHash(f), f.sprites.data(), f.sprites.size() * sizeof(Sprite));
+}
+
+// A column of wall found by drawWalls, ready to be textured: rows [y1, y2)
+// stepping by yStep, reading texture row texY + step * i for the ith.
+struct WallColumn {
+	int x;
+	int texture;
+	int texX;
+	int y1;
+	int y2;
+	float texY;
+	float step;
+};
+
+// Rows [top, bottom) of a column left open, after drawWalls has drawn every
+// wall surface up to depth, for whatever is farther away.
+struct ColumnClip {
+	float depth;
+	int top;
+	int bottom;
+};
+
+// A floor or ceiling at height z seen in columns minX to maxX, in rows
+// [top[x], bottom[x]) of each; columns where top >= bottom do not show it.
+struct Visplane {
+	float z;
+	int texture;
+	int minX;
+	int maxX;
+	vector<int16_t> top;
+	vector<int16_t> bottom;
+};
+
 class Game {
 public:
 	Game(Window* window);
@@ -88,24 +448,142 @@ public:
 
 	void init();
 	void update();
-	void draw();
-
-	void drawFloor();
-	void drawWalls();
-	void drawSprites();
+	// Fills f in place, so a reused snapshot keeps its allocations. alpha
+	// blends from the state before the last tick (0) to the current one (1).
+	void writeSnapshot(FrameSnapshot& f, float alpha = 1) const;
+	void draw(const FrameSnapshot& f);
+
+	// Level to set up on init.
+	Level level;
+
+	// Time spent in each pass of the last draw, in performance counter ticks.
+	uint64_t stageTime[numRenderStages];
+	// Hardware counter deltas for each pass of the last draw, if perfCounters
+	// is set.
+	PerfSample stagePerf[numRenderStages];
+
+	void drawFloor(const FrameSnapshot& f);
+	void drawWalls(const FrameSnapshot& f);
+	void drawSprites(const FrameSnapshot& f);
+	void drawMinimap(const FrameSnapshot& f);
+
+	// Ray of each column and the matching projection, set up by drawWalls
+	// and shared with drawSprites.
+	ColumnRays columnRays;
+
+	// drawWalls finds every column's wall first, then textures them grouped
+	// by texture so one texture at a time stays in cache, left to right
+	// within each group.
+	vector<WallColumn> wallColumns;
+	vector<WallColumn> sortedWallColumns;
+	vector<int> textureStarts;
+	// Only turned off to benchmark the difference.
+	bool groupWallsByTexture = true;
+
+	// For column x, columnClips[columnClipStart[x]] up to
+	// columnClips[columnClipStart[x + 1]] are the open windows after each
+	// wall surface drawWalls drew in it, nearest first. Sprites are clipped to
+	// the last one nearer than them.
+	vector<ColumnClip> columnClips;
+	vector<int> columnClipStart;
+	// Wall faces drawWalls found behind the first in each column, last frame.
+	int extraWallHits = 0;
+
+	// Parts of drawWalls for column x, whose rows [clipTop, clipBottom) are
+	// still open. Walls stand on the floor, so each one drawn closes the
+	// window from its top down; ceilings close it from the top of the screen.
+	void queueFace(const FrameSnapshot& f, int x, int texture, int side, float d, float zBottom, float zTop, int clipTop, int clipBottom, int& y1, int& y2);
+	void wallFace(const FrameSnapshot& f, int x, int tile, int side, float d, float base, int clipTop, int& clipBottom);
+	void wallRoof(const FrameSnapshot& f, int x, int tile, float dIn, float dOut, int clipTop, int& clipBottom);
+	void wallsBehind(const FrameSnapshot& f, int x, int firstTile, float d, int& clipTop, int& clipBottom);
+	void sectorPlanes(const FrameSnapshot& f, int x, int tile, float dIn, float dOut, int& clipTop, int& clipBottom);
+	void sectorEdge(const FrameSnapshot& f, int x, int from, int to, int side, float d, int& clipTop, int& clipBottom);
+
+	// Floors and ceilings on maps with sectors. drawWalls works out which
+	// rows of each column show them, between the walls, and drawFloor then
+	// draws them along rows. The first numVisplanes are in use.
+	vector<Visplane> visplanes;
+	int numVisplanes = 0;
+	void addPlaneRows(const FrameSnapshot& f, int x, float z, int texture, int top, int bottom);
+	void drawVisplanes(const FrameSnapshot& f);
+	// Column each row's current span started at, while drawVisplanes works
+	// along a visplane.
+	vector<int> spanStarts;
+
+	// Rotation-only reprojection. While the camera stays in place, drawWalls
+	// keeps each frame's wall hits and reuses them for columns of the next
+	// frame that look between two old columns hitting the same wall; only the
+	// rest (newly exposed columns and wall edges) are cast again.
+	bool reproject = false;
+	// Columns of the last drawWalls that were reprojected rather than cast.
+	int reusedColumns = 0;
+	bool reprojectColumn(vec2 pos, vec2 rayDir, RaycastResult& res) const;
+
+	// Hits of the last frame drawn, one per column, and the view they were
+	// cast from. Empty when there is nothing to reuse.
+	vector<RaycastResult> wallHits;
+	vector<RaycastResult> nextWallHits;
+	vec2 wallHitsPos;
+	vec2 wallHitsDir;
+	float wallHitsU;
+
+	// Checkerboard rendering. Each draw, drawFloor and drawWalls shade only
+	// the pixels where x + y + checkerPhase is even, alternating between
+	// frames, and reconstruct fills in the rest from the frame before.
+	bool checkerboard = false;
+	// Set by draw; -1 shades every pixel.
+	int checkerPhase = -1;
+	uint32_t checkerFrame = 0;
+	void reconstruct(const FrameSnapshot& f);
+	// Floor and wall pixels shaded by earlier frames, and viewCameraHash of
+	// the last frame to write them.
+	vector<RGB> history;
+	uint64_t historyCamera = 0;
+	// Whether the last draw shaded every floor and wall pixel for its own
+	// camera. A checkerboard draw after the camera moved only estimates half
+	// of them, and needs drawing once more to fill them in.
+	bool drawSettled = true;
 
 	vector<Sprite> sprites;
+	vector<Sprite> drawList;
+
+	vector<Entity> entities;
+	JobSystem jobs;
+	JobGraph tickGraph;
+	LineOfSight los;
+	vector<LosQuery> losQueries;
+	vector<uint8_t> losResults;
+	vector<int> losIndices;
+	FlowField flow;
+
+	PotentiallyVisibleSet pvs;
+	// Entities per job in updateEntities; 0 picks it from the entity count and
+	// the size of the pool.
+	int entityGrain = 0;
+	void spawnEntities(int count);
+	void updateEntities();
+	void moveEntities(int begin, int end);
+	void collideEntities(int begin, int end);
+	void thinkEntities(int begin, int end);
 
 	RGB& pixel(int x, int y);
 
 	Window* window;
 	RGB* pixelPtr = nullptr;
+	// Row length of pixelPtr.
+	int pixelStride = windowWidth;
 	SDL_Renderer* renderer;
 
-	float fovX;
+	float fovX = degToRad(70);
 	float fovY;
 	void setFovX(float f);
 
+	// Internal render resolution. The projection depends on it, so it goes
+	// through setResolution.
+	int renderWidth = windowWidth;
+	int renderHeight = windowHeight;
+	void setResolution(int w, int h);
+
 	vec2 pos;
 	float posZ;
 	float angle;
@@ -117,12 +595,41 @@ public:
 	float bobZ;
 	float bobM;
 
+	float vz;
+	bool canJump;
+
+	// Camera state before the last tick.
+	vec2 prevPos;
+	float prevAngle;
+	float prevCamZ;
+
+	// Input for the next update, and the number of updates so far. The
+	// simulation only depends on these, so replaying the same inputs gives the
+	// same result.
+	InputFrame input = { 0, 0 };
+	uint32_t tick = 0;
+
 	void setPos(vec2 p);
 	void setAngle(float a);
 
-	vector<RGB> texture;
-	vector<RGB> texture2;
-	vector<RGB> barrelTexture;
+	// Every texture, by index. Floor and sprite have one each, walls two per
+	// type (see wallTexture), after them in the same order as
+	// wallTextureFiles. Ceilings use one of the wall textures.
+	TextureAtlas<RGB> textures;
+	int floorTexture;
+	int ceilingTexture;
+	int spriteTexture;
+	int firstWallTexture;
+	int wallTexture(int tile, int side) const;
+};
+
+// A finished frame at window resolution, how long it took to draw, the
+// viewHash of the snapshot it shows, and Game::drawSettled after drawing it.
+struct RenderedFrame {
+	vector<RGB> pixels;
+	float renderTime;
+	uint64_t view;
+	bool settled;
 };
 
 class Window {
@@ -131,7 +638,26 @@ public:
 	~Window();
 
 	void init();
+	void initHeadless();
 	void run();
+	// Snapshots the game and renders it into pixelPtr on the calling thread.
+	void drawFrame();
+	void renderFrame(const FrameSnapshot& f, RGB* target);
+	void renderLoop();
+	void publishSnapshot(float alpha = 1);
+
+	// Sets the internal render resolution, which dynamic resolution then
+	// scales down from.
+	void setResolution(int w, int h);
+	void adjustResolution(float renderTime);
+	void upscaleFrame(const RGB* src, int srcW, int srcH, RGB* dst);
+	JobGraph upscaleGraph;
+	bool dynamicResolution = false;
+	// Render time dynamic resolution aims for, in seconds.
+	float targetFrameTime = dt;
+	float resolutionScale = 1;
+	int baseWidth = windowWidth;
+	int baseHeight = windowHeight;
 
 	SDL_Window* window = nullptr;
 	SDL_Renderer* renderer = nullptr;
@@ -141,20 +667,44 @@ public:
 	bool keyDown(int key);
 	bool keyPressed(int key);
 
+	// Mouse motion since the last tick that consumed it.
+	int mouseRelX = 0;
+	InputFrame sampleInput();
+	unique_ptr<InputRecorder> recorder;
+	// Receives the first frame drawn after each tick.
+	unique_ptr<VideoCapture> capture;
+
 	SDL_Texture* screenTexture = nullptr;
-	unique_ptr<RGB[]> pixelBuf;
-	unique_ptr<float[]> depthBuf;
+	// Target of drawFrame, at the render resolution.
+	vector<RGB> pixelBuf;
 	RGB* pixelPtr = nullptr;
+	// Render thread target when the render resolution differs from the
+	// window's.
+	vector<RGB> renderBuf;
 
 	bool gameRunning = true;
 	float time = 0;
 	float lastTime = 0;
 	float timeAccumulator = 0;
 
+	// While running with a window, the main thread simulates and publishes
+	// snapshots, a render thread draws each one into a frame and the main
+	// thread uploads and presents the newest finished frame.
+	FrameSnapshot view;
+	// viewHash of the last snapshot published. A snapshot that would render
+	// the same image is not published, so an idle view costs no rendering
+	// or texture uploads.
+	uint64_t publishedView = 0;
+	// Set when the unchanged view has been published again because the frame
+	// on show was not settled, so that is only asked for once per frame.
+	bool settleRequested = false;
+	TripleBuffer<FrameSnapshot> snapshots;
+	TripleBuffer<RenderedFrame> frames;
+
 	Game game;
 };
 
-Game::Game(Window* window) : window(window) {}
+Game::Game(Window* window) : level(defaultLevel()), window(window) {}
 
 Game::~Game() {}
 
@@ -163,75 +713,203 @@ const float HEIGHT = 16;
 const float speed = 256;
 const float turnSpeed = M_PI / 2;
 
+const float playerRadius = 16;
+// Highest step a mover walks up without jumping, and the room the player
+// needs between their eye and a ceiling.
+const float maxStepHeight = 8;
+const float playerHeadroom = 8;
+
 const float mouseSensitivity = 0.01f;
-int mouseRelX;
 
-float vz = 0;
 float gravity = -320;
 float jumpPower = 100;
-bool canJump = true;
 
 float bobFreq = 10;
 float bobAmp = 2;
 float bobGrow = 20;
 float bobDecay = 20;
 
-vector<RGB> loadTexture(const char* path) {
+// Highest the player's eye gets, at the top of a jump or of the view bob on
+// the highest floor.
+float maxEyeZ() {
+	int highest = 0;
+	for (uint8_t z : mapFloors) highest = max(highest, (int)z);
+	return highest + fmaxf(HEIGHT + jumpPower * jumpPower / (-2 * gravity), HEIGHT + bobAmp);
+}
+
+const int numEntities = 16;
+// Fewest entities per job. Below this, queueing a job costs about as much as
+// the work in it.
+const int minEntityGrain = 8;
+const float entitySpeed = 96;
+const float entityRadius = 16;
+const float entitySightRange = 6 * 64;
+const float entityWanderTurn = 0.3f;
+
+// Wall textures by map value: tiles with value v use wallTextureFiles[v - 1],
+// wrapping around past the end.
+const char* const wallTextureFiles[] = {
+	"wolf3d/eagle.png",
+	"wolf3d/redbrick.png",
+	"wolf3d/purplestone.png",
+	"wolf3d/greystone.png",
+	"wolf3d/bluestone.png",
+	"wolf3d/mossy.png",
+	"wolf3d/wood.png",
+	"wolf3d/colorstone.png",
+};
+const int numWallTypes = sizeof(wallTextureFiles) / sizeof(wallTextureFiles[0]);
+// Map value whose wall texture also covers the faces between floors and
+// ceilings of different heights, and its darker copy the ceilings.
+const int ledgeWallType = 4;
+
+// Adds the image at path to atlas. With darkened set, a darker copy is added
+// straight after it, for faces crossed along y so the two sides of a corner
+// stand apart.
+int loadTexture(TextureAtlas<RGB>& atlas, const char* path, bool darkened = false) {
 	int x, y, n;
-	RGB* data = (RGB*)stbi_load(path, &x, &y, &n, 0);
+	RGB* data = (RGB*)stbi_load(path, &x, &y, &n, 3);
+	if (data == nullptr) {
+		cerr << "Cannot load " << path << ": " << stbi_failure_reason() << "\n";
+		throw runtime_error(path);
+	}
 	vector<RGB> pixels;
 	pixels.assign(data, data + y * x);
-	return pixels;
+	stbi_image_free(data);
+
+	int index;
+	try {
+		index = atlas.add(pixels.data(), x, y);
+	}
+	catch (const runtime_error& e) {
+		throw runtime_error(string(path) + ": " + e.what());
+	}
+	if (darkened) {
+		for (RGB& p : pixels) {
+			p = { (uint8_t)(p.r * 200 / 255), (uint8_t)(p.g * 200 / 255), (uint8_t)(p.b * 200 / 255) };
+		}
+		atlas.add(pixels.data(), x, y);
+	}
+	return index;
+}
+
+const char inputMagic[4] = { 'R', 'C', 'I', 'N' };
+const uint8_t inputVersion = 1;
+
+bool InputFrame::keyDown(int key) const {
+	for (int i = 0; i < numInputKeys; i++) {
+		if (inputKeys[i] == key) return (keys >> i) & 1;
+	}
+	return false;
+}
+
+InputRecorder::InputRecorder(const char* path) : file(path, ios::binary) {
+	if (!file) throw runtime_error(string("Cannot write ") + path);
+	file.write(inputMagic, 4);
+	file.put(inputVersion);
+	file.put(FPS);
+}
+
+void InputRecorder::write(const InputFrame& in) {
+	uint16_t m = (uint16_t)in.mouseRelX;
+	char record[4] = {
+		(char)(in.keys & 0xff), (char)(in.keys >> 8),
+		(char)(m & 0xff), (char)(m >> 8),
+	};
+	file.write(record, 4);
+}
+
+InputReplay::InputReplay(const char* path) : file(path, ios::binary) {
+	char header[6];
+	if (!file || !file.read(header, 6) || memcmp(header, inputMagic, 4) != 0) {
+		throw runtime_error(string("Not an input recording: ") + path);
+	}
+	if (header[4] != inputVersion || header[5] != FPS) {
+		throw runtime_error(string("Input recording has a different version or tick rate: ") + path);
+	}
+}
+
+bool InputReplay::read(InputFrame& in) {
+	uint8_t record[4];
+	if (!file.read((char*)record, 4)) return false;
+	in.keys = record[0] | (record[1] << 8);
+	in.mouseRelX = (int16_t)(record[2] | (record[3] << 8));
+	return true;
 }
 
 void Game::init() {
-	pixelPtr = window->pixelPtr;
 	renderer = window->renderer;
 
+	useLevelMap(level);
+
 	setFovX(degToRad(70));
-	setPos({ 0, 0 });
-	setAngle(0);
+	setPos(level.spawn);
+	setAngle(level.spawnAngle);
 	
-	posZ = HEIGHT;
+	posZ = floorHeight(pos) + HEIGHT;
 	camZ = posZ;
 
+	prevPos = pos;
+	prevAngle = angle;
+	prevCamZ = camZ;
+
 	bobZ = 0;
 	bobM = 0;
 
-	texture = loadTexture("wolf3d/wood.png");
-	texture2 = loadTexture("wolf3d/eagle.png");
-	barrelTexture = loadTexture("sus.png");
+	vz = 0;
+	canJump = true;
+	tick = 0;
 
-	sprites.push_back(Sprite{ 4*64, 6*64 });
-	sprites.push_back(Sprite{ 3*64, 6*64 });
-	sprites.push_back(Sprite{ 4*64, 5*64 });
-	sprites.push_back(Sprite{ 3*64, 5*64 });
+	textures = TextureAtlas<RGB>();
+	floorTexture = loadTexture(textures, "wolf3d/wood.png");
+	spriteTexture = loadTexture(textures, "sus.png");
+	firstWallTexture = textures.count();
+	for (const char* path : wallTextureFiles) {
+		loadTexture(textures, path, true);
+	}
+	ceilingTexture = wallTexture(ledgeWallType, 1);
+
+	sprites = level.sprites;
+	wallHits.clear();
+
+	pvs.build(jobs, maxEyeZ());
+
+	spawnEntities(numEntities);
 }
 
 void Game::update() {
+	TRACE_SCOPE("Game::update");
 	//cout << window->time << "\n";
 
+	prevPos = pos;
+	prevAngle = angle;
+	prevCamZ = camZ;
+
 	bool moving = false;
-	if (window->keyDown(SDL_SCANCODE_W)) {
-		pos.x += dir.x * speed * dt;
-		pos.y += dir.y * speed * dt;
+	vec2 move = { 0, 0 };
+	if (input.keyDown(SDL_SCANCODE_W)) {
+		move.x += dir.x * speed * dt;
+		move.y += dir.y * speed * dt;
 		moving = true;
 	}
-	if (window->keyDown(SDL_SCANCODE_S)) {
-		pos.x -= dir.x * speed * dt;
-		pos.y -= dir.y * speed * dt;
+	if (input.keyDown(SDL_SCANCODE_S)) {
+		move.x -= dir.x * speed * dt;
+		move.y -= dir.y * speed * dt;
 		moving = true;
 	}
-	if (window->keyDown(SDL_SCANCODE_A)) {
-		pos.x += dir.y * speed * dt;
-		pos.y -= dir.x * speed * dt;
+	if (input.keyDown(SDL_SCANCODE_A)) {
+		move.x += dir.y * speed * dt;
+		move.y -= dir.x * speed * dt;
 		moving = true;
 	}
-	if (window->keyDown(SDL_SCANCODE_D)) {
-		pos.x -= dir.y * speed * dt;
-		pos.y += dir.x * speed * dt;
+	if (input.keyDown(SDL_SCANCODE_D)) {
+		move.x -= dir.y * speed * dt;
+		move.y += dir.x * speed * dt;
 		moving = true;
 	}
+	if (moving) {
+		moveCircle(pos, move, playerRadius, nullptr, posZ - HEIGHT);
+	}
 
 	if (moving) {
 		bobM = fminf(bobM + bobGrow * dt, 1);
@@ -240,50 +918,96 @@ void Game::update() {
 	else {
 		bobM -= bobM * bobDecay * dt;
 	}
-	bobZ = sinf(window->time * bobFreq) * bobAmp * bobM;
+	bobZ = sinf(tick * dt * bobFreq) * bobAmp * bobM;
 
 	int turnDir = 0;
-	turnDir += window->keyDown(SDL_SCANCODE_RIGHT);
-	turnDir -= window->keyDown(SDL_SCANCODE_LEFT);
+	turnDir += input.keyDown(SDL_SCANCODE_RIGHT);
+	turnDir -= input.keyDown(SDL_SCANCODE_LEFT);
 	if (turnDir != 0) {
 		setAngle(angle + turnDir * turnSpeed * dt);
 	}
 
-	if (mouseRelX != 0) {
-		setAngle(angle + mouseRelX * mouseSensitivity);
+	if (input.mouseRelX != 0) {
+		setAngle(angle + input.mouseRelX * mouseSensitivity);
 	}
 
-	if (canJump && window->keyDown(SDL_SCANCODE_SPACE)) {
+	if (canJump && input.keyDown(SDL_SCANCODE_SPACE)) {
 		vz += jumpPower;
 		canJump = false;
 	}
 	posZ += vz * dt;
 	vz += gravity * dt;
-	if (posZ < HEIGHT) {
-		posZ = HEIGHT;
+	float ceiling = ceilingHeight(pos);
+	if (ceiling > 0 && posZ > ceiling - playerHeadroom) {
+		posZ = ceiling - playerHeadroom;
+		vz = fminf(vz, 0);
+	}
+	// Standing on the floor of the tile underfoot, so steps up are climbed
+	// straight away and walking off a ledge falls.
+	float ground = floorHeight(pos) + HEIGHT;
+	if (posZ < ground) {
+		posZ = ground;
 		vz = 0;
 		canJump = true;
 	}
+	else if (posZ > ground) {
+		canJump = false;
+	}
 
-	if (window->keyDown(SDL_SCANCODE_I)) {
+	if (input.keyDown(SDL_SCANCODE_I)) {
 		setFovX(fovX + degToRad(1));
 	}
-	if (window->keyDown(SDL_SCANCODE_K)) {
+	if (input.keyDown(SDL_SCANCODE_K)) {
 		setFovX(fovX - degToRad(1));
 	}
 
-	if (posZ <= HEIGHT) {
+	if (posZ <= ground) {
 		camZ = posZ + bobZ;
 	}
 	else {
 		camZ = posZ;
 	}
+
+	{
+		TRACE_SCOPE("flowField");
+		flow.setTarget(pos);
+	}
+	updateEntities();
+
+	tick++;
 }
 
-void Game::draw() {
-	drawFloor();
-	drawWalls();
-	drawSprites();
+void Game::draw(const FrameSnapshot& f) {
+	TRACE_SCOPE("Game::draw");
+
+	auto timeStage = [&](int stage, auto pass) {
+		uint64_t t = SDL_GetPerformanceCounter();
+		PerfSample p;
+		if (perfCounters) p = perfCounters->read();
+		pass();
+		stageTime[stage] = SDL_GetPerformanceCounter() - t;
+		if (perfCounters) stagePerf[stage] = perfCounters->read() - p;
+	};
+
+	checkerPhase = checkerboard && f.width > 1 && f.height > 1 ? checkerFrame++ & 1 : -1;
+
+	// Floors and ceilings of maps with sectors only fill the rows between
+	// walls, so the walls are found first.
+	if (mapHasSectors) {
+		timeStage(STAGE_WALLS, [&] { drawWalls(f); });
+		timeStage(STAGE_FLOOR, [&] { drawFloor(f); });
+	}
+	else {
+		timeStage(STAGE_FLOOR, [&] { drawFloor(f); });
+		timeStage(STAGE_WALLS, [&] { drawWalls(f); });
+	}
+	drawSettled = true;
+	timeStage(STAGE_RECONSTRUCT, [&] {
+		if (checkerPhase >= 0) reconstruct(f);
+	});
+	timeStage(STAGE_SPRITES, [&] { drawSprites(f); });
+
+	checkerPhase = -1;
 }
 
 //const uint8_t floorTexture[] = {
@@ -307,47 +1031,211 @@ const int texSizeLog = 6;
 const int texMask = (1 << texSizeLog) - 1;
 const int textureSize = 1 << texSizeLog;
 
-const int halfHeight = height / 2;
+void Game::writeSnapshot(FrameSnapshot& f, float alpha) const {
+	// At alpha 1 the current state is used as is, so headless rendering gives
+	// exactly the same images as before interpolation.
+	bool blend = alpha < 1;
+
+	f.tick = tick;
+	if (blend) {
+		f.pos = lerp(prevPos, pos, alpha);
+		f.angle = lerp(prevAngle, angle, alpha);
+		f.dir = { cosf(f.angle), sinf(f.angle) };
+		f.camZ = lerp(prevCamZ, camZ, alpha);
+	}
+	else {
+		f.pos = pos;
+		f.angle = angle;
+		f.dir = dir;
+		f.camZ = camZ;
+	}
+	f.fovX = fovX;
+	f.camDist = camDist;
+	f.invCamDist = invCamDist;
+	f.width = renderWidth;
+	f.height = renderHeight;
+
+	// Look up the camera's PVS row once and only pass on what it can see.
+	// Camera paths can go higher than the player, and see over walls the PVS
+	// counts as blocking.
+	const uint64_t* pvsRow = f.camZ <= pvs.eyeZ ? pvs.row(f.pos) : nullptr;
+	f.sprites.clear();
+	for (const Sprite& s : sprites) {
+		if (pvs.visible(pvsRow, s.pos, textureSize / 2)) f.sprites.push_back(s);
+	}
+	for (const Entity& e : entities) {
+		vec2 p = blend ? lerp(e.prev, e.pos, alpha) : e.pos;
+		if (pvs.visible(pvsRow, p, textureSize / 2)) f.sprites.push_back(Sprite{ p });
+	}
+}
+
+void Game::drawFloor(const FrameSnapshot& f) {
+	TRACE_SCOPE("drawFloor");
+	if (mapHasSectors) {
+		drawVisplanes(f);
+		return;
+	}
+
+	const int width = f.width;
+	const int height = f.height;
+	const int halfHeight = height / 2;
 
-void Game::drawFloor() {
 	for (int i = halfHeight; i < height; i++) {
 		float y = i - halfHeight;
 
-		float d = camZ * camDist / y;
+		float d = f.camZ * f.camDist / y;
 
-		float f1 = width * d * invCamDist;
+		float f1 = width * d * f.invCamDist;
 
-		float flx = pos.x + dir.x * d - dir.y * -f1;
-		float fly = pos.y + dir.y * d + dir.x * -f1;
+		float flx = f.pos.x + f.dir.x * d - f.dir.y * -f1;
+		float fly = f.pos.y + f.dir.y * d + f.dir.x * -f1;
 
-		float frx = pos.x + dir.x * d - dir.y * f1;
-		float fry = pos.y + dir.y * d + dir.x * f1;
+		float frx = f.pos.x + f.dir.x * d - f.dir.y * f1;
+		float fry = f.pos.y + f.dir.y * d + f.dir.x * f1;
 
 		float stepX = (frx - flx) / width;
 		float stepY = (fry - fly) / width;
 
-		float fx = flx;
-		float fy = fly;
+		int x0 = checkerPhase < 0 ? 0 : (i + checkerPhase) & 1;
+		int xStep = checkerPhase < 0 ? 1 : 2;
+
+		withTextureSize(textures.sizeLog(floorTexture), [&](auto sizeLog) {
+			TextureSampler<RGB, decltype(sizeLog)::value> tex(textures, floorTexture);
 
-		for (int x = 0; x < width; x++) {
-			int fx2 = floorf(fx);
-			int fy2 = floorf(fy);
+			// One texture per tile, so world units scale to texels by
+			// tex.size / textureSize.
+			float scale = (float)tex.size / textureSize;
+			float fx = (flx + stepX * x0) * scale;
+			float fy = (fly + stepY * x0) * scale;
+			float dx = stepX * xStep * scale;
+			float dy = stepY * xStep * scale;
 
-			RGB pix = texture[((fy2 & texMask) << texSizeLog) + (fx2 & texMask)];
-			pixel(x, i) = pix;
+			for (int x = x0; x < width; x += xStep) {
+				int fx2 = floorf(fx);
+				int fy2 = floorf(fy);
 
-			/*uint8_t pix = floorTexture[((fy2 & texMask) << texSizeLog) + (fx2 & texMask)];
-			pixel(x, i) = { pix, pix, 0 };*/
+				pixel(x, i) = tex.fetch(fx2, fy2);
 
-			//pixel(x, i) = { (uint8_t)(fx * 255), (uint8_t)(fy * 255), 0 };
+				/*uint8_t pix = floorTexture[((fy2 & texMask) << texSizeLog) + (fx2 & texMask)];
+				pixel(x, i) = { pix, pix, 0 };*/
 
-			fx += stepX;
-			fy += stepY;
+				//pixel(x, i) = { (uint8_t)(fx * 255), (uint8_t)(fy * 255), 0 };
+
+				fx += dx;
+				fy += dy;
+			}
+		});
+	}
+}
+
+// Adds rows [top, bottom) of column x to a visplane at height z. Columns come
+// in order, so a visplane takes them if it has not reached x yet, or if the
+// rows join the ones it already has there; otherwise a new one is started.
+void Game::addPlaneRows(const FrameSnapshot& f, int x, float z, int texture, int top, int bottom) {
+	for (int i = numVisplanes - 1; i >= 0; i--) {
+		Visplane& p = visplanes[i];
+		if (p.z != z || p.texture != texture) continue;
+		if (p.maxX < x) {
+			for (int c = p.maxX + 1; c < x; c++) p.top[c] = p.bottom[c] = 0;
+			p.maxX = x;
+			p.top[x] = top;
+			p.bottom[x] = bottom;
+			return;
+		}
+		if (p.bottom[x] == top) {
+			p.bottom[x] = bottom;
+			return;
 		}
+		if (p.top[x] == bottom) {
+			p.top[x] = top;
+			return;
+		}
+	}
+
+	if (numVisplanes == (int)visplanes.size()) visplanes.emplace_back();
+	Visplane& p = visplanes[numVisplanes++];
+	p.z = z;
+	p.texture = texture;
+	p.minX = x;
+	p.maxX = x;
+	p.top.resize(f.width);
+	p.bottom.resize(f.width);
+	p.top[x] = top;
+	p.bottom[x] = bottom;
+}
+
+// Draws the visplanes from the last drawWalls. Going across each one a column
+// at a time, a row's span starts where the column's rows first take it in
+// and ends where they leave it, so every span is textured the way drawFloor
+// does a row: one distance for all of it and a constant step per pixel.
+void Game::drawVisplanes(const FrameSnapshot& f) {
+	TRACE_SCOPE("drawVisplanes");
+	const int width = f.width;
+	const int halfHeight = f.height / 2;
+	spanStarts.resize(f.height);
+
+	for (int v = 0; v < numVisplanes; v++) {
+		const Visplane& p = visplanes[v];
+		withTextureSize(textures.sizeLog(p.texture), [&](auto sizeLog) {
+			TextureSampler<RGB, decltype(sizeLog)::value> tex(textures, p.texture);
+			float scale = (float)tex.size / textureSize;
+
+			auto span = [&](int y, int x1, int x2) {
+				// Distance to the middle of the row, which is never on the
+				// horizon.
+				float d = (f.camZ - p.z) * f.camDist / (y - halfHeight + 0.5f);
+
+				float f1 = width * d * f.invCamDist;
+
+				float flx = f.pos.x + f.dir.x * d - f.dir.y * -f1;
+				float fly = f.pos.y + f.dir.y * d + f.dir.x * -f1;
+
+				float frx = f.pos.x + f.dir.x * d - f.dir.y * f1;
+				float fry = f.pos.y + f.dir.y * d + f.dir.x * f1;
+
+				float stepX = (frx - flx) / width;
+				float stepY = (fry - fly) / width;
+
+				int x0 = checkerPhase < 0 ? x1 : x1 + ((x1 + y + checkerPhase) & 1);
+				int xStep = checkerPhase < 0 ? 1 : 2;
+
+				float fx = (flx + stepX * x0) * scale;
+				float fy = (fly + stepY * x0) * scale;
+				float dx = stepX * xStep * scale;
+				float dy = stepY * xStep * scale;
+
+				for (int x = x0; x < x2; x += xStep) {
+					pixel(x, y) = tex.fetch((int)floorf(fx), (int)floorf(fy));
+					fx += dx;
+					fy += dy;
+				}
+			};
+
+			// Rows of the column before; INT_MAX for none.
+			int top = INT_MAX;
+			int bottom = INT_MAX;
+			for (int x = p.minX; x <= p.maxX + 1; x++) {
+				int t = INT_MAX;
+				int b = INT_MAX;
+				if (x <= p.maxX && p.top[x] < p.bottom[x]) {
+					t = p.top[x];
+					b = p.bottom[x];
+				}
+
+				// Spans of rows above or below this column's end before it.
+				for (int y = top; y < bottom && y < t; y++) span(y, spanStarts[y], x);
+				for (int y = max(top, b); y < bottom; y++) span(y, spanStarts[y], x);
+				for (int y = t; y < b && y < top; y++) spanStarts[y] = x;
+				for (int y = max(t, bottom); y < b; y++) spanStarts[y] = x;
+
+				top = t;
+				bottom = b;
+			}
+		});
 	}
 }
 
-const uint8_t map[] = {
+const uint8_t defaultMap[] = {
 	1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
 	1, 0, 1, 0, 0, 0, 1, 0, 0, 1,
 	1, 0, 1, 0, 0, 0, 0, 0, 0, 1,
@@ -359,390 +1247,3150 @@ const uint8_t map[] = {
 	1, 0, 0, 0, 0, 0, 0, 0, 0, 1,
 	1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
 };
-const int mapSize = 10;
+const int defaultMapSize = 10;
+
+// Wall heights are given in level files in steps of wallHeightStep.
+const int defaultWallHeight = 32;
+const int wallHeightStep = 8;
+
+Level defaultLevel() {
+	Level l;
+	l.name = "default";
+	l.size = defaultMapSize;
+	l.tiles.assign(defaultMap, defaultMap + defaultMapSize * defaultMapSize);
+	l.heights.assign(l.tiles.size(), defaultWallHeight);
+	l.floors.assign(l.tiles.size(), 0);
+	l.ceilings.assign(l.tiles.size(), 0);
+	l.spawn = { 1.5f * 64, 4.5f * 64 };
+	l.spawnAngle = 0;
+
+	l.sprites.push_back(Sprite{ 4*64, 6*64 });
+	l.sprites.push_back(Sprite{ 3*64, 6*64 });
+	l.sprites.push_back(Sprite{ 4*64, 5*64 });
+	l.sprites.push_back(Sprite{ 3*64, 5*64 });
+
+	// Walk down the open room, turn to face the barrels, jump, then widen the
+	// view while turning back up the corridor.
+	l.path = {
+		{ 0, { 1.5f, 4.5f }, 0, 70, 16 },
+		{ 2, { 7.5f, 4.5f }, 0, 70, 16 },
+		{ 3, { 7.5f, 5.5f }, 180, 70, 16 },
+		{ 4, { 5.5f, 7.5f }, 200, 70, 48 },
+		{ 5, { 5.5f, 7.5f }, 240, 70, 16 },
+		{ 7, { 1.5f, 7.5f }, 270, 100, 16 },
+		{ 9, { 1.5f, 1.5f }, 270, 50, 16 },
+	};
+	return l;
+}
 
-struct Raycast {
-	vec2 o;
-	vec2 d;
-};
+// Level files are plain text. Blank lines and lines starting with '#' are
+// ignored. "map" is followed by one line per row of tiles, '.' or a digit per
+// tile picking the wall texture (see wallTextureFiles); the map must be
+// square. "heights" is optionally followed by rows of the same size, where a
+// digit 1-9 makes the wall on that tile that many times wallHeightStep high
+// and '.' leaves it at defaultWallHeight. "floors" and "ceilings" rows give
+// the heights of open tiles in the same steps: floors 0-9 ('.' for 0) and
+// ceilings 1-9 ('.' for open sky), which must be above the floor. The other
+// lines are
+//   spawn <x> <y> <angle>
+//   sprite <x> <y>
+//   key <time> <x> <y> <angle> <fov> <z>
+// with positions in tiles, angles in degrees and time in seconds.
+Level loadLevel(const char* path) {
+	ifstream file(path);
+	if (!file) throw runtime_error(string("Cannot open level ") + path);
+
+	Level l;
+	l.name = path;
+	l.size = 0;
+	l.spawn = { 1.5f * textureSize, 1.5f * textureSize };
+	l.spawnAngle = 0;
+
+	auto fail = [&](int line, const char* what) {
+		throw runtime_error(string(path) + ":" + to_string(line) + ": " + what);
+	};
 
-struct RaycastResult {
-	vec2i tile;
-	float t;
-	int side;
-};
+	string line;
+	int lineNo = 0;
+	// Keyword of the section the rows that follow belong to, if any.
+	string section;
+	while (getline(file, line)) {
+		lineNo++;
+		if (!line.empty() && line.back() == '\r') line.pop_back();
+
+		if (!section.empty()) {
+			bool isRow = !line.empty() && all_of(line.begin(), line.end(), [](char c) {
+				return c == '.' || (c >= '0' && c <= '9');
+			});
+			if (isRow && section == "map") {
+				if (l.size == 0) l.size = (int)line.size();
+				if ((int)line.size() != l.size) fail(lineNo, "map rows differ in length");
+				for (char c : line) l.tiles.push_back(c == '.' ? 0 : c - '0');
+				continue;
+			}
+			if (isRow) {
+				if ((int)line.size() != l.size) fail(lineNo, (section + " rows differ in length from the map").c_str());
+				for (char c : line) {
+					if (section == "heights") {
+						if (c == '0') fail(lineNo, "wall heights are 1-9 or '.'");
+						l.heights.push_back(c == '.' ? defaultWallHeight : (c - '0') * wallHeightStep);
+					}
+					else if (section == "floors") {
+						l.floors.push_back(c == '.' ? 0 : (c - '0') * wallHeightStep);
+					}
+					else {
+						if (c == '0') fail(lineNo, "ceilings are 1-9 or '.'");
+						l.ceilings.push_back(c == '.' ? 0 : (c - '0') * wallHeightStep);
+					}
+				}
+				continue;
+			}
+			section.clear();
+		}
 
-RaycastResult raycastMap(Raycast r) {
-	vec2 o = r.o;
-	o.x /= textureSize;
-	o.y /= textureSize;
-	vec2 d = r.d;
+		if (line.empty() || line[0] == '#') continue;
+
+		istringstream in(line);
+		string word;
+		in >> word;
+		if (word == "map") {
+			section = word;
+		}
+		else if (word == "heights" || word == "floors" || word == "ceilings") {
+			if (l.size == 0) fail(lineNo, (word + " must come after the map").c_str());
+			section = word;
+		}
+		else if (word == "spawn") {
+			if (!(in >> l.spawn.x >> l.spawn.y >> l.spawnAngle)) fail(lineNo, "expected spawn x y angle");
+			l.spawn = { l.spawn.x * textureSize, l.spawn.y * textureSize };
+			l.spawnAngle = degToRad(l.spawnAngle);
+		}
+		else if (word == "sprite") {
+			Sprite s;
+			if (!(in >> s.pos.x >> s.pos.y)) fail(lineNo, "expected sprite x y");
+			s.pos = { s.pos.x * textureSize, s.pos.y * textureSize };
+			l.sprites.push_back(s);
+		}
+		else if (word == "key") {
+			CameraKey k;
+			if (!(in >> k.time >> k.pos.x >> k.pos.y >> k.angle >> k.fov >> k.z)) fail(lineNo, "expected key time x y angle fov z");
+			l.path.push_back(k);
+		}
+		else {
+			fail(lineNo, "unknown keyword");
+		}
+	}
+
+	if (l.size == 0 || (int)l.tiles.size() != l.size * l.size) fail(lineNo, "map missing or not square");
+	if (l.heights.empty()) l.heights.assign(l.tiles.size(), defaultWallHeight);
+	if (l.floors.empty()) l.floors.assign(l.tiles.size(), 0);
+	if (l.ceilings.empty()) l.ceilings.assign(l.tiles.size(), 0);
+	if (l.heights.size() != l.tiles.size()) fail(lineNo, "heights do not cover the map");
+	if (l.floors.size() != l.tiles.size()) fail(lineNo, "floors do not cover the map");
+	if (l.ceilings.size() != l.tiles.size()) fail(lineNo, "ceilings do not cover the map");
+	for (size_t i = 0; i < l.tiles.size(); i++) {
+		if (l.tiles[i] == 0 && l.ceilings[i] && l.ceilings[i] <= l.floors[i]) {
+			fail(lineNo, ("ceiling not above the floor at " + to_string(i % l.size) + " " + to_string(i / l.size)).c_str());
+		}
+	}
+	return l;
+}
+
+void useLevelMap(const Level& l) {
+	map = l.tiles;
+	mapSize = l.size;
+	mapHeights = l.heights;
+	mapFloors = l.floors;
+	mapCeilings = l.ceilings;
+	measureMap();
+}
+
+void measureMap() {
+	int lowest = INT_MAX;
+	int highest = 0;
+	mapHasSectors = false;
+	for (int i = 0; i < (int)map.size(); i++) {
+		if (map[i]) {
+			highest = max(highest, (int)mapHeights[i]);
+			continue;
+		}
+		lowest = min(lowest, (int)mapFloors[i]);
+		highest = max(highest, max((int)mapFloors[i], (int)mapCeilings[i]));
+		if (mapFloors[i] || mapCeilings[i]) mapHasSectors = true;
+	}
+	mapBottomZ = lowest == INT_MAX ? 0 : lowest;
+	mapTopZ = highest;
+}
 
+// Walks the map cells crossed by the ray o + t * d (o in tile units) in order,
+// calling visit(mapX, mapY, t, side) for each cell after the starting one. t is
+// where the ray enters the cell and side is the axis of the crossed cell
+// boundary (0 = x, 1 = y). Stops when visit returns true, when t passes tMax,
+// or when the ray leaves the map. Returns whether visit stopped the walk.
+template <class F>
+bool traverseMap(vec2 o, vec2 d, float tMax, F visit) {
 	int mapX = (int)floorf(o.x);
 	int mapY = (int)floorf(o.y);
 
-	float stepX = d.x > 0 ? 1 : -1;
-	float stepY = d.y > 0 ? 1 : -1;
+	int stepX = d.x > 0 ? 1 : -1;
+	int stepY = d.y > 0 ? 1 : -1;
 
 	/*float tmaxX = (ceilf(o.x) - o.x) / d.x * stepX;
 	float tmaxY = (ceilf(o.y) - o.y) / d.y * stepY;*/
 
-	float tmaxX = 0;
-	float tmaxY = 0;
+	// An axis the ray does not move along is never crossed.
+	float tmaxX = INFINITY;
+	float tmaxY = INFINITY;
+	float tDeltaX = INFINITY;
+	float tDeltaY = INFINITY;
 
-	if (stepX == 1) {
-		tmaxX = (mapX - o.x + 1) / d.x;
-	}
-	else {
-		tmaxX = (mapX - o.x) / d.x;
-	}
-	if (stepY == 1) {
-		tmaxY = (mapY - o.y + 1) / d.y;
+	if (d.x != 0) {
+		if (stepX == 1) {
+			tmaxX = (mapX - o.x + 1) / d.x;
+		}
+		else {
+			tmaxX = (mapX - o.x) / d.x;
+		}
+		tDeltaX = 1 / d.x * stepX;
 	}
-	else {
-		tmaxY = (mapY - o.y) / d.y;
+	if (d.y != 0) {
+		if (stepY == 1) {
+			tmaxY = (mapY - o.y + 1) / d.y;
+		}
+		else {
+			tmaxY = (mapY - o.y) / d.y;
+		}
+		tDeltaY = 1 / d.y * stepY;
 	}
 
-	float tDeltaX = 1 / d.x * stepX;
-	float tDeltaY = 1 / d.y * stepY;
-
-	float t = 0;
-	int side = 0;
 	while (mapX >= 0 && mapX < mapSize && mapY >= 0 && mapY < mapSize) {
+		float t;
+		int side;
 		if (tmaxX < tmaxY) {
+			t = tmaxX;
 			tmaxX += tDeltaX;
 			mapX += stepX;
-
-			if (map[mapY * mapSize + mapX] > 0) {
-				t = tmaxX - tDeltaX;
-				side = 0;
-				break;
-			}
+			side = 0;
 		}
 		else {
+			t = tmaxY;
 			tmaxY += tDeltaY;
 			mapY += stepY;
-
-			if (map[mapY * mapSize + mapX] > 0) {
-				t = tmaxY - tDeltaY;
-				side = 1;
-				break;
-			}
+			side = 1;
 		}
-	}
 
-	if (mapX < 0 || mapX > mapSize - 1 || mapY < 0 || mapY > mapSize - 1) {
-		return { {0, 0}, -1 };
+		if (t > tMax) break;
+		if (mapX < 0 || mapX > mapSize - 1 || mapY < 0 || mapY > mapSize - 1) break;
+
+		if (visit(mapX, mapY, t, side)) return true;
 	}
 
-	return {
-		{(int)(o.x + t * d.x), (int)(o.y + t * d.y)},
-		t * textureSize,
-		side
-	};
+	return false;
 }
 
-void Game::drawWalls() {
-	int posx = (int)(pos.x * textureSize);
-	int posy = (int)(pos.y * textureSize);
-
-	SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
-	float rSize = 1;
-	float hRSize = rSize / 2;
-	SDL_Rect rect = {posx - hRSize, posy - hRSize, rSize, rSize};
-	SDL_RenderFillRect(renderer, &rect);
+RaycastResult raycastMapFloat(Raycast r) {
+	vec2 o = r.o;
+	o.x /= textureSize;
+	o.y /= textureSize;
 
-	float dirLen = camDist / 10;
-	SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
-	SDL_RenderDrawLine(renderer, posx, posy, posx + (int)(dirLen * dir.x), posy + (int)(dirLen * dir.y));
+	RaycastResult res = { {0, 0}, -1, 0 };
+	traverseMap(o, r.d, INFINITY, [&](int mapX, int mapY, float t, int side) {
+		if (map[mapY * mapSize + mapX] == 0) return false;
+		res = { {mapX, mapY}, t * textureSize, side };
+		return true;
+	});
 
-	float u = tan(fovX / 2) * 2;
-	float rDirX = dir.x + dir.y * u;
-	float rDirY = dir.y - dir.x * u;
+	return res;
+}
 
-	float rDirX_R = dir.x - dir.y * u;
-	float rDirY_R = dir.y + dir.x * u;
+// The same walk as raycastMapFloat in integers. The origin becomes 32.32
+// fixed-point tiles and the ray parameter is kept with 32 fractional bits.
+// Where the ray first crosses each axis, and how far apart the crossings are,
+// are worked out once per ray; after that each step is an add and a compare.
+// No rounding error builds up from cell to cell, and rays through a tile
+// corner always take the same side.
+//
+// Crossing times past never are clamped to it, which only happens for
+// crossings more than 2^30 ray lengths away, far outside any map. The other
+// axis leaves the map long before then, so the clamped one is never stepped
+// twice and cannot overflow. A ray with both components under 1/4096 has no
+// usable direction and hits nothing.
+//
+// Hit distances are more accurate than raycastMapFloat's, so they can differ
+// in the last bits. Where a hit lands on a texel boundary that picks the
+// neighbouring texel, so renders with FIXED_POINT_RAYCAST differ from the
+// float ones in a few pixels of some columns.
+RaycastResult raycastMapFixed(Raycast r) {
+	const int fracBits = 32;
+	const int64_t one = 1ll << fracBits;
+	const float minDir = 1.0f / 4096;
+	const int64_t never = INT64_MAX / 2;
+	if (fabsf(r.d.x) < minDir && fabsf(r.d.y) < minDir) return { {0, 0}, -1, 0 };
+
+	// Exact: a float position has fewer significant bits than this keeps.
+	int64_t px = (int64_t)floor(r.o.x * ((double)one / textureSize));
+	int64_t py = (int64_t)floor(r.o.y * ((double)one / textureSize));
+	int mapX = (int)(px >> fracBits);
+	int mapY = (int)(py >> fracBits);
+	int64_t fracX = px & (one - 1);
+	int64_t fracY = py & (one - 1);
+
+	int stepX = r.d.x > 0 ? 1 : -1;
+	int stepY = r.d.y > 0 ? 1 : -1;
+
+	double invX = 1.0 / fabsf(r.d.x);
+	double invY = 1.0 / fabsf(r.d.y);
+	auto crossing = [never](int64_t fixedDist, float dir, double inv) {
+		if (dir == 0) return never;
+		double t = fixedDist * inv;
+		return t < (double)never ? (int64_t)t : never;
+	};
+	int64_t tDeltaX = crossing(one, r.d.x, invX);
+	int64_t tDeltaY = crossing(one, r.d.y, invY);
+	int64_t tmaxX = crossing(stepX == 1 ? one - fracX : fracX, r.d.x, invX);
+	int64_t tmaxY = crossing(stepY == 1 ? one - fracY : fracY, r.d.y, invY);
+
+	while (true) {
+		int64_t t;
+		int side;
+		if (tmaxX < tmaxY) {
+			t = tmaxX;
+			tmaxX += tDeltaX;
+			mapX += stepX;
+			side = 0;
+		}
+		else {
+			t = tmaxY;
+			tmaxY += tDeltaY;
+			mapY += stepY;
+			side = 1;
+		}
+
+		if (mapX < 0 || mapX > mapSize - 1 || mapY < 0 || mapY > mapSize - 1) break;
+		if (map[mapY * mapSize + mapX] != 0) {
+			return { {mapX, mapY}, (float)(t * ((double)textureSize / one)), side };
+		}
+	}
+
+	return { {0, 0}, -1, 0 };
+}
+
+// Defining FIXED_POINT_RAYCAST makes the renderer cast rays with
+// raycastMapFixed. Both versions are always built so the microbenchmarks can
+// compare them.
+RaycastResult raycastMap(Raycast r) {
+#ifdef FIXED_POINT_RAYCAST
+	return raycastMapFixed(r);
+#else
+	return raycastMapFloat(r);
+#endif
+}
+
+// Whether a walk that has crossed kx cell boundaries along x and ky along y,
+// with the next crossings at xOut and yOut and the last ones at xIn and yIn,
+// stepped into its current cell across side. traverseMap steps along x only
+// while that crossing comes strictly first.
+template <class T>
+bool enteredAcross(int side, int kx, int ky, T xIn, T xOut, T yIn, T yOut) {
+	if (side == 0) return kx > 0 && (ky == 0 || yIn <= xIn) && xIn < yOut;
+	return ky > 0 && (kx == 0 || xIn < yIn) && yIn <= xOut;
+}
+
+// The distance raycastMapFloat reports for a ray whose first wall is tile,
+// entered across side, or false if the ray does not reach tile that way. The
+// crossing times are summed exactly as traverseMap sums them, so the result
+// matches a cast bit for bit, but no map cells are read on the way. Whether
+// an earlier wall is in the way is up to the caller.
+bool hitDistanceFloat(Raycast r, vec2i tile, int side, float& t) {
+	vec2 o = { r.o.x / textureSize, r.o.y / textureSize };
+	int mapX = (int)floorf(o.x);
+	int mapY = (int)floorf(o.y);
+	int kx = (tile.x - mapX) * (r.d.x > 0 ? 1 : -1);
+	int ky = (tile.y - mapY) * (r.d.y > 0 ? 1 : -1);
+	if (kx < 0 || ky < 0 || (kx > 0 && r.d.x == 0) || (ky > 0 && r.d.y == 0)) return false;
+
+	// The crossing before the k-th and the k-th, as traverseMap reaches them.
+	auto crossings = [](float o, float d, int map, int k, float& in, float& out) {
+		if (d == 0) {
+			in = -INFINITY;
+			out = INFINITY;
+			return;
+		}
+		float delta = d > 0 ? 1 / d : 1 / d * -1;
+		in = -INFINITY;
+		out = d > 0 ? (map - o + 1) / d : (map - o) / d;
+		for (int i = 0; i < k; i++) {
+			in = out;
+			out += delta;
+		}
+	};
+	float xIn, xOut, yIn, yOut;
+	crossings(o.x, r.d.x, mapX, kx, xIn, xOut);
+	crossings(o.y, r.d.y, mapY, ky, yIn, yOut);
+	if (!enteredAcross(side, kx, ky, xIn, xOut, yIn, yOut)) return false;
+
+	t = (side == 0 ? xIn : yIn) * textureSize;
+	return true;
+}
+
+// hitDistanceFloat for raycastMapFixed.
+bool hitDistanceFixed(Raycast r, vec2i tile, int side, float& t) {
+	const int fracBits = 32;
+	const int64_t one = 1ll << fracBits;
+	const float minDir = 1.0f / 4096;
+	const int64_t never = INT64_MAX / 2;
+	if (fabsf(r.d.x) < minDir && fabsf(r.d.y) < minDir) return false;
+
+	int64_t px = (int64_t)floor(r.o.x * ((double)one / textureSize));
+	int64_t py = (int64_t)floor(r.o.y * ((double)one / textureSize));
+	int kx = (tile.x - (int)(px >> fracBits)) * (r.d.x > 0 ? 1 : -1);
+	int ky = (tile.y - (int)(py >> fracBits)) * (r.d.y > 0 ? 1 : -1);
+	if (kx < 0 || ky < 0) return false;
+
+	// Crossings past never are never stepped to, as in raycastMapFixed.
+	auto crossings = [never, one](int64_t frac, float d, int k, int64_t& in, int64_t& out) {
+		if (d == 0) {
+			in = INT64_MIN;
+			out = never;
+			return k == 0;
+		}
+		double inv = 1.0 / fabsf(d);
+		double first = (d > 0 ? one - frac : frac) * inv;
+		double delta = one * inv;
+		if (first + k * delta >= (double)never) return k == 0;
+		in = k == 0 ? INT64_MIN : (int64_t)first + (k - 1) * (int64_t)delta;
+		out = (int64_t)first + k * (int64_t)delta;
+		return true;
+	};
+	int64_t xIn, xOut, yIn, yOut;
+	if (!crossings(px & (one - 1), r.d.x, kx, xIn, xOut)) return false;
+	if (!crossings(py & (one - 1), r.d.y, ky, yIn, yOut)) return false;
+	if (!enteredAcross(side, kx, ky, xIn, xOut, yIn, yOut)) return false;
+
+	t = (float)((side == 0 ? xIn : yIn) * ((double)textureSize / one));
+	return true;
+}
+
+bool hitDistance(Raycast r, vec2i tile, int side, float& t) {
+#ifdef FIXED_POINT_RAYCAST
+	return hitDistanceFixed(r, tile, side, t);
+#else
+	return hitDistanceFloat(r, tile, side, t);
+#endif
+}
+
+// Circle collision against the tile grid, in world units. Tiles outside the
+// map count as solid.
+
+const float collisionSkin = 0.01f;
+const int maxSlideIterations = 3;
+
+bool solidTile(int x, int y) {
+	if (x < 0 || x >= mapSize || y < 0 || y >= mapSize) return true;
+	return map[y * mapSize + x] > 0;
+}
+
+// Whether a mover with its feet at feetZ is kept out of tile (x, y): by a
+// wall, by a floor more than maxStepHeight above its feet, or by a ceiling too
+// low to get under.
+bool blocksMover(int x, int y, float feetZ) {
+	if (solidTile(x, y)) return true;
+	if (!mapHasSectors) return false;
+	int tile = y * mapSize + x;
+	float floor = mapFloors[tile];
+	if (floor > feetZ + maxStepHeight) return true;
+	return mapCeilings[tile] && mapCeilings[tile] < fmaxf(floor, feetZ) + HEIGHT + playerHeadroom;
+}
+
+// Height of the floor and of the ceiling (0 for none) of the open tile
+// containing p; 0 elsewhere.
+float floorHeight(vec2 p) {
+	int x = (int)floorf(p.x / textureSize);
+	int y = (int)floorf(p.y / textureSize);
+	return solidTile(x, y) ? 0 : mapFloors[y * mapSize + x];
+}
+
+float ceilingHeight(vec2 p) {
+	int x = (int)floorf(p.x / textureSize);
+	int y = (int)floorf(p.y / textureSize);
+	return solidTile(x, y) ? 0 : mapCeilings[y * mapSize + x];
+}
+
+// Time of impact of a circle of radius r moving from o along d (t in [0, 1])
+// against the box [b0, b1]. Only reports hits earlier than tBest; circles that
+// already overlap the box are left to depenetrateCircle.
+bool sweepCircleBox(vec2 o, vec2 d, float r, vec2 b0, vec2 b1, float& tBest, vec2& normal) {
+	float tEnter = -INFINITY;
+	float tExit = INFINITY;
+
+	if (d.x != 0) {
+		float t1 = (b0.x - r - o.x) / d.x;
+		float t2 = (b1.x + r - o.x) / d.x;
+		tEnter = fmaxf(tEnter, fminf(t1, t2));
+		tExit = fminf(tExit, fmaxf(t1, t2));
+	}
+	else if (o.x <= b0.x - r || o.x >= b1.x + r) {
+		return false;
+	}
+	if (d.y != 0) {
+		float t1 = (b0.y - r - o.y) / d.y;
+		float t2 = (b1.y + r - o.y) / d.y;
+		tEnter = fmaxf(tEnter, fminf(t1, t2));
+		tExit = fminf(tExit, fmaxf(t1, t2));
+	}
+	else if (o.y <= b0.y - r || o.y >= b1.y + r) {
+		return false;
+	}
+
+	if (tEnter > tExit || tExit < 0 || tEnter >= tBest) return false;
+
+	// Point where the circle centre enters the box grown by r.
+	float te = fmaxf(tEnter, 0);
+	vec2 p = { o.x + d.x * te, o.y + d.y * te };
+	vec2 c = { fminf(fmaxf(p.x, b0.x), b1.x), fminf(fmaxf(p.y, b0.y), b1.y) };
+
+	bool faceX = p.y >= b0.y && p.y <= b1.y;
+	bool faceY = p.x >= b0.x && p.x <= b1.x;
+
+	if (faceX || faceY) {
+		if (tEnter < 0) return false;
+		if (faceX) {
+			normal = { p.x < b0.x ? -1.0f : 1.0f, 0 };
+		}
+		else {
+			normal = { 0, p.y < b0.y ? -1.0f : 1.0f };
+		}
+		tBest = tEnter;
+		return true;
+	}
+
+	// Corner region: the grown box has rounded corners, so test against the
+	// circle of radius r around the corner.
+	float mx = o.x - c.x;
+	float my = o.y - c.y;
+	float a = d.x * d.x + d.y * d.y;
+	float b = mx * d.x + my * d.y;
+	float cc = mx * mx + my * my - r * r;
+	if (cc <= 0 || b >= 0 || a == 0) return false;
+
+	float disc = b * b - a * cc;
+	if (disc < 0) return false;
+
+	float t = (-b - sqrtf(disc)) / a;
+	if (t < 0 || t >= tBest) return false;
+
+	float hx = o.x + d.x * t - c.x;
+	float hy = o.y + d.y * t - c.y;
+	float len = sqrtf(hx * hx + hy * hy);
+	normal = { hx / len, hy / len };
+	tBest = t;
+	return true;
+}
+
+// Earliest hit of a circle moving from o by d against the map. Candidate tiles
+// come from walking the centre's path with the same traversal as raycastMap
+// and testing the tiles around each visited cell; a tile the circle touches at
+// time t is always next to the cell holding the centre at t, so the walk can
+// stop once it enters cells later than the best hit so far.
+bool sweepCircle(vec2 o, vec2 d, float r, float feetZ, float& tHit, vec2& normal) {
+	int reach = (int)ceilf(r / textureSize);
+	tHit = 1;
+	bool hit = false;
+
+	auto testAround = [&](int cx, int cy) {
+		for (int y = cy - reach; y <= cy + reach; y++) {
+			for (int x = cx - reach; x <= cx + reach; x++) {
+				if (!blocksMover(x, y, feetZ)) continue;
+				vec2 b0 = { (float)(x * textureSize), (float)(y * textureSize) };
+				vec2 b1 = { b0.x + textureSize, b0.y + textureSize };
+				hit |= sweepCircleBox(o, d, r, b0, b1, tHit, normal);
+			}
+		}
+	};
+
+	testAround((int)floorf(o.x / textureSize), (int)floorf(o.y / textureSize));
+
+	vec2 to = { o.x / textureSize, o.y / textureSize };
+	vec2 td = { d.x / textureSize, d.y / textureSize };
+	traverseMap(to, td, 1, [&](int mapX, int mapY, float t, int) {
+		if (t > tHit) return true;
+		testAround(mapX, mapY);
+		return false;
+	});
+
+	return hit;
+}
+
+// Pushes a circle out of any tiles it overlaps.
+void depenetrateCircle(vec2& p, float r, float feetZ) {
+	int reach = (int)ceilf(r / textureSize);
+	int cx = (int)floorf(p.x / textureSize);
+	int cy = (int)floorf(p.y / textureSize);
+
+	for (int y = cy - reach; y <= cy + reach; y++) {
+		for (int x = cx - reach; x <= cx + reach; x++) {
+			if (!blocksMover(x, y, feetZ)) continue;
+
+			float x0 = (float)(x * textureSize);
+			float y0 = (float)(y * textureSize);
+			float x1 = x0 + textureSize;
+			float y1 = y0 + textureSize;
+
+			float nx = p.x - fminf(fmaxf(p.x, x0), x1);
+			float ny = p.y - fminf(fmaxf(p.y, y0), y1);
+			float dist2 = nx * nx + ny * ny;
+			if (dist2 >= r * r) continue;
+
+			if (dist2 > 0) {
+				float dist = sqrtf(dist2);
+				float push = r - dist + collisionSkin;
+				p.x += nx / dist * push;
+				p.y += ny / dist * push;
+			}
+			else {
+				// Centre inside the tile: leave through the nearest face.
+				float left = p.x - x0;
+				float right = x1 - p.x;
+				float top = p.y - y0;
+				float bottom = y1 - p.y;
+				float m = fminf(fminf(left, right), fminf(top, bottom));
+				if (m == left) p.x = x0 - r - collisionSkin;
+				else if (m == right) p.x = x1 + r + collisionSkin;
+				else if (m == top) p.y = y0 - r - collisionSkin;
+				else p.y = y1 + r + collisionSkin;
+			}
+		}
+	}
+}
+
+// Whether any tile blocking a mover with its feet at feetZ touches the box
+// [x0, x1] x [y0, y1].
+bool solidInBox(float x0, float y0, float x1, float y1, float feetZ) {
+	int tx0 = (int)floorf(x0 / textureSize);
+	int ty0 = (int)floorf(y0 / textureSize);
+	int tx1 = (int)floorf(x1 / textureSize);
+	int ty1 = (int)floorf(y1 / textureSize);
+	for (int y = ty0; y <= ty1; y++) {
+		for (int x = tx0; x <= tx1; x++) {
+			if (blocksMover(x, y, feetZ)) return true;
+		}
+	}
+	return false;
+}
+
+// Moves a circle by delta, stopping at walls and sliding along them. Returns
+// whether anything was hit, and the last hit normal.
+// feetZ is the height of the mover's feet, which decides the steps and
+// ceilings it can pass.
+bool moveCircle(vec2& p, vec2 delta, float r, vec2* hitNormal, float feetZ) {
+	// Most movers are in open space: if nothing solid is near the swept
+	// bounds, skip the sweep entirely.
+	float x0 = fminf(p.x, p.x + delta.x) - r;
+	float y0 = fminf(p.y, p.y + delta.y) - r;
+	float x1 = fmaxf(p.x, p.x + delta.x) + r;
+	float y1 = fmaxf(p.y, p.y + delta.y) + r;
+	if (!solidInBox(x0, y0, x1, y1, feetZ)) {
+		p.x += delta.x;
+		p.y += delta.y;
+		return false;
+	}
+
+	depenetrateCircle(p, r, feetZ);
+
+	bool hit = false;
+	for (int i = 0; i < maxSlideIterations; i++) {
+		if (delta.x == 0 && delta.y == 0) break;
+
+		float t;
+		vec2 n;
+		if (!sweepCircle(p, delta, r, feetZ, t, n)) {
+			p.x += delta.x;
+			p.y += delta.y;
+			break;
+		}
+
+		hit = true;
+		if (hitNormal) *hitNormal = n;
+
+		p.x += delta.x * t + n.x * collisionSkin;
+		p.y += delta.y * t + n.y * collisionSkin;
+
+		// Slide: keep the part of the remaining motion along the wall.
+		float rx = delta.x * (1 - t);
+		float ry = delta.y * (1 - t);
+		float into = rx * n.x + ry * n.y;
+		delta = { rx - n.x * into, ry - n.y * into };
+	}
+
+	return hit;
+}
+
+struct CircleMove {
+	vec2 pos;
+	vec2 delta;
+	float radius;
+	bool hit;
+	vec2 normal;
+};
+
+// Batch form of moveCircle. Movers do not collide with each other, so any
+// range of the batch can be processed independently. Like entities, each
+// mover stands on the floor of the tile it starts the move in.
+void moveCircles(CircleMove* moves, int count) {
+	for (int i = 0; i < count; i++) {
+		CircleMove& m = moves[i];
+		m.hit = moveCircle(m.pos, m.delta, m.radius, &m.normal, floorHeight(m.pos));
+	}
+}
+
+// Whether the segment from a to b crosses no solid tile. Unlike raycastMap this
+// stops at the first wall and does not work out where it was hit. Walls lower
+// than eyeZ are looked over.
+bool lineOfSight(vec2 a, vec2 b, float eyeZ = 0) {
+	vec2 o = { a.x / textureSize, a.y / textureSize };
+	vec2 d = { (b.x - a.x) / textureSize, (b.y - a.y) / textureSize };
+	return !traverseMap(o, d, 1, [&](int mapX, int mapY, float, int) {
+		int tile = mapY * mapSize + mapX;
+		return map[tile] > 0 && mapHeights[tile] >= eyeZ;
+	});
+}
+
+const int losGrain = 64;
+
+void LineOfSight::newTick() {
+	// Bumping the generation invalidates every entry without touching them.
+	generation++;
+	used = 0;
+	cacheHits = 0;
+	cacheMisses = 0;
+}
+
+void LineOfSight::reserve(int count) {
+	if ((used + count) * 2 <= (int)table.size()) return;
+
+	size_t size = table.empty() ? 256 : table.size();
+	while ((size_t)(used + count) * 2 > size) size *= 2;
+
+	vector<Entry> old;
+	old.swap(table);
+	table.assign(size, Entry{ {0, 0, 0, 0}, 0, false, 0 });
+
+	for (const Entry& e : old) {
+		if (e.generation != generation) continue;
+		LosQuery q;
+		memcpy(&q, e.key, sizeof(q));
+		bool found;
+		*find(q, found) = e;
+	}
+}
+
+// Returns the entry for q, or the empty slot where it belongs.
+LineOfSight::Entry* LineOfSight::find(const LosQuery& q, bool& found) {
+	uint32_t key[4];
+	memcpy(key, &q, sizeof(key));
+
+	uint32_t h = key[0] * 0x9e3779b1u;
+	h = (h ^ key[1]) * 0x85ebca77u;
+	h = (h ^ key[2]) * 0xc2b2ae3du;
+	h = (h ^ key[3]) * 0x27d4eb2fu;
+	h ^= h >> 15;
+
+	size_t mask = table.size() - 1;
+	for (size_t i = h & mask;; i = (i + 1) & mask) {
+		Entry& e = table[i];
+		if (e.generation != generation) {
+			found = false;
+			return &e;
+		}
+		if (memcmp(e.key, key, sizeof(key)) == 0) {
+			found = true;
+			return &e;
+		}
+	}
+}
+
+bool LineOfSight::query(vec2 from, vec2 to) {
+	reserve(1);
+
+	LosQuery q = { from, to };
+	bool found;
+	Entry* e = find(q, found);
+	if (found) {
+		cacheHits++;
+		return e->visible;
+	}
+
+	cacheMisses++;
+	memcpy(e->key, &q, sizeof(e->key));
+	e->generation = generation;
+	e->pending = false;
+	e->visible = lineOfSight(from, to);
+	used++;
+	return e->visible;
+}
+
+// The cache is only touched on the calling thread: queries are first looked up
+// and new ones given a slot, then only the misses are traced in parallel, and
+// their results stored afterwards.
+void LineOfSight::queryBatch(const LosQuery* queries, uint8_t* results, int count, JobSystem& jobs) {
+	reserve(count);
+
+	misses.clear();
+	repeats.clear();
+	slots.resize(count);
+
+	for (int i = 0; i < count; i++) {
+		bool found;
+		Entry* e = find(queries[i], found);
+		slots[i] = e;
+
+		if (!found) {
+			memcpy(e->key, &queries[i], sizeof(e->key));
+			e->generation = generation;
+			e->pending = true;
+			used++;
+			misses.push_back(i);
+		}
+		else if (e->pending) {
+			repeats.push_back(i);
+		}
+		else {
+			results[i] = e->visible;
+		}
+	}
+
+	cacheHits += count - (int)misses.size();
+	cacheMisses += (int)misses.size();
+
+	graph.parallelFor("lineOfSight", (int)misses.size(), losGrain, [&](int begin, int end) {
+		for (int j = begin; j < end; j++) {
+			int i = misses[j];
+			results[i] = lineOfSight(queries[i].from, queries[i].to);
+		}
+	});
+	jobs.run(graph);
+
+	for (int i : misses) {
+		slots[i]->visible = results[i];
+		slots[i]->pending = false;
+	}
+	for (int i : repeats) {
+		results[i] = slots[i]->visible;
+	}
+}
+
+const int flowUnreachable = INT_MAX / 2;
+const int flowStraightCost = 5;
+const int flowDiagonalCost = 7;
+
+const int flowNeighbours[8][2] = {
+	{1, 0}, {-1, 0}, {0, 1}, {0, -1},
+	{1, 1}, {-1, 1}, {1, -1}, {-1, -1},
+};
+
+// Bit i is set if a move in direction flowNeighbours[i] from (x, y) is
+// possible.
+uint8_t flowMoves(int x, int y) {
+	uint8_t moves = 0;
+	for (int i = 0; i < 8; i++) {
+		int dx = flowNeighbours[i][0];
+		int dy = flowNeighbours[i][1];
+		if (solidTile(x + dx, y + dy)) continue;
+
+		bool diagonal = dx != 0 && dy != 0;
+		if (diagonal && (solidTile(x + dx, y) || solidTile(x, y + dy))) continue;
+
+		moves |= 1 << i;
+	}
+	return moves;
+}
+
+// Calls f(neighbour, cost) for every cell reachable from c in one step.
+template <class F>
+void FlowField::forEachNeighbour(int c, F f) const {
+	uint8_t m = moves[c];
+	for (int i = 0; m != 0; i++, m >>= 1) {
+		if ((m & 1) == 0) continue;
+		f(c + flowNeighbours[i][1] * mapSize + flowNeighbours[i][0], i < 4 ? flowStraightCost : flowDiagonalCost);
+	}
+}
+
+void FlowField::resize() {
+	size = mapSize * mapSize;
+	g.assign(size, flowUnreachable);
+	rhs.assign(size, flowUnreachable);
+
+	moves.resize(size);
+	for (int y = 0; y < mapSize; y++) {
+		for (int x = 0; x < mapSize; x++) {
+			moves[y * mapSize + x] = flowMoves(x, y);
+		}
+	}
+
+	// No path is longer than visiting every cell diagonally.
+	buckets.assign(size * flowDiagonalCost + 1, vector<int>());
+	current = (int)buckets.size();
+}
+
+int FlowField::calcRhs(int c) const {
+	if (c == target) return 0;
+
+	int best = flowUnreachable;
+	forEachNeighbour(c, [&](int n, int cost) {
+		best = min(best, g[n] + cost);
+	});
+	return min(best, flowUnreachable);
+}
+
+void FlowField::push(int c) {
+	int key = min(g[c], rhs[c]);
+	if (key >= flowUnreachable) return;
+	buckets[key].push_back(c);
+	current = min(current, key);
+}
+
+void FlowField::updateCell(int c) {
+	rhs[c] = calcRhs(c);
+	if (g[c] != rhs[c]) push(c);
+}
+
+void FlowField::computeDistances() {
+	while (current < (int)buckets.size()) {
+		vector<int>& bucket = buckets[current];
+		if (bucket.empty()) {
+			current++;
+			continue;
+		}
+
+		int c = bucket.back();
+		bucket.pop_back();
+
+		// Cells are not removed from buckets when their key changes, so skip
+		// stale copies.
+		if (g[c] == rhs[c] || min(g[c], rhs[c]) != current) continue;
+		lastUpdated++;
+
+		if (g[c] > rhs[c]) {
+			// Distance went down: neighbours can only get better through c.
+			g[c] = rhs[c];
+			forEachNeighbour(c, [&](int n, int cost) {
+				if (n != target && g[c] + cost < rhs[n]) {
+					rhs[n] = g[c] + cost;
+					push(n);
+				}
+			});
+		}
+		else {
+			// Distance went up: only neighbours whose best step was through c
+			// need to look again.
+			int old = g[c];
+			g[c] = flowUnreachable;
+			push(c);
+			forEachNeighbour(c, [&](int n, int cost) {
+				if (rhs[n] == old + cost) updateCell(n);
+			});
+		}
+	}
+}
+
+void FlowField::setTarget(vec2 p) {
+	int x = (int)floorf(p.x / textureSize);
+	int y = (int)floorf(p.y / textureSize);
+
+	if (size != mapSize * mapSize) {
+		resize();
+		target = -1;
+	}
+
+	int c = y * mapSize + x;
+	if (c == target || solidTile(x, y)) return;
+
+	int old = target;
+	target = c;
+	lastUpdated = 0;
+
+	updateCell(c);
+	if (old >= 0) updateCell(old);
+	computeDistances();
+}
+
+int FlowField::distance(int x, int y) const {
+	if (solidTile(x, y) || size == 0) return flowUnreachable;
+	return g[y * mapSize + x];
+}
+
+vec2 FlowField::direction(vec2 p) const {
+	int x = (int)floorf(p.x / textureSize);
+	int y = (int)floorf(p.y / textureSize);
+
+	int best = distance(x, y);
+	if (best == 0 || best >= flowUnreachable) return { 0, 0 };
+
+	int next = -1;
+	forEachNeighbour(y * mapSize + x, [&](int n, int) {
+		if (g[n] < best) {
+			best = g[n];
+			next = n;
+		}
+	});
+	if (next < 0) return { 0, 0 };
+
+	float dx = (next % mapSize + 0.5f) * textureSize - p.x;
+	float dy = (next / mapSize + 0.5f) * textureSize - p.y;
+	float len = sqrtf(dx * dx + dy * dy);
+	if (len == 0) return { 0, 0 };
+	return { dx / len, dy / len };
+}
+
+// Points inside a tile that visibility between two tiles is sampled from,
+// kept slightly inside so rays do not graze the tile edges.
+const float pvsSamples[] = { 0.02f, 0.5f, 0.98f };
+const int pvsGrain = 4;
+
+bool tilesVisible(int ax, int ay, int bx, int by, float eyeZ) {
+	for (float sax : pvsSamples) {
+		for (float say : pvsSamples) {
+			vec2 a = { (ax + sax) * textureSize, (ay + say) * textureSize };
+			for (float sbx : pvsSamples) {
+				for (float sby : pvsSamples) {
+					vec2 b = { (bx + sbx) * textureSize, (by + sby) * textureSize };
+					if (lineOfSight(a, b, eyeZ)) return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+void PotentiallyVisibleSet::mirror() {
+	for (int a = 0; a < tiles; a++) {
+		for (int b = a + 1; b < tiles; b++) {
+			uint64_t& ab = bits[(size_t)a * rowWords + b / 64];
+			uint64_t& ba = bits[(size_t)b * rowWords + a / 64];
+			uint64_t abBit = 1ull << (b % 64);
+			uint64_t baBit = 1ull << (a % 64);
+			if ((ab & abBit) || (ba & baBit)) {
+				ab |= abBit;
+				ba |= baBit;
+			}
+		}
+	}
+}
+
+// Visibility is symmetric, so each job only traces pairs (a, b) with b > a
+// for its own rows, and the lower half is mirrored afterwards.
+//
+// The sampled test misses lines that only clear a corner from between the
+// sample points. Such a line passes close to a sample point's line to a
+// neighbouring tile, so the sampled set is then dilated by one tile at each
+// end of every pair: a sees b if a sees any neighbour of b, or the other way
+// round.
+void PotentiallyVisibleSet::build(JobSystem& jobs, float eyeZ) {
+	this->eyeZ = eyeZ;
+	tiles = mapSize * mapSize;
+	rowWords = (tiles + 63) / 64;
+	bits.assign((size_t)tiles * rowWords, 0);
+
+	graph.parallelFor("pvsBuild", tiles, pvsGrain, [this, eyeZ](int begin, int end) {
+		for (int a = begin; a < end; a++) {
+			if (map[a] > 0) continue;
+
+			uint64_t* r = &bits[(size_t)a * rowWords];
+			r[a / 64] |= 1ull << (a % 64);
+
+			int ax = a % mapSize;
+			int ay = a / mapSize;
+			for (int b = a + 1; b < tiles; b++) {
+				if (map[b] > 0) continue;
+				if (tilesVisible(ax, ay, b % mapSize, b / mapSize, eyeZ)) {
+					r[b / 64] |= 1ull << (b % 64);
+				}
+			}
+		}
+	});
+	jobs.run(graph);
+	mirror();
+
+	vector<uint64_t> sampled = bits;
+	graph.parallelFor("pvsDilate", tiles, pvsGrain, [this, &sampled](int begin, int end) {
+		for (int a = begin; a < end; a++) {
+			if (map[a] > 0) continue;
+
+			const uint64_t* in = &sampled[(size_t)a * rowWords];
+			uint64_t* out = &bits[(size_t)a * rowWords];
+			for (int b = 0; b < tiles; b++) {
+				if (!((in[b / 64] >> (b % 64)) & 1)) continue;
+
+				int bx = b % mapSize;
+				int by = b / mapSize;
+				for (int y = max(by - 1, 0); y <= min(by + 1, mapSize - 1); y++) {
+					for (int x = max(bx - 1, 0); x <= min(bx + 1, mapSize - 1); x++) {
+						int t = y * mapSize + x;
+						if (map[t] == 0) out[t / 64] |= 1ull << (t % 64);
+					}
+				}
+			}
+		}
+	});
+	jobs.run(graph);
+	mirror();
+}
+
+int PotentiallyVisibleSet::tileAt(vec2 p) const {
+	int x = (int)floorf(p.x / textureSize);
+	int y = (int)floorf(p.y / textureSize);
+	if (x < 0 || x >= mapSize || y < 0 || y >= mapSize) return -1;
+	return y * mapSize + x;
+}
+
+const uint64_t* PotentiallyVisibleSet::row(vec2 p) const {
+	int t = tileAt(p);
+	if (t < 0 || t >= tiles || map[t] > 0) return nullptr;
+	return &bits[(size_t)t * rowWords];
+}
+
+bool PotentiallyVisibleSet::visible(const uint64_t* row, vec2 p) const {
+	if (row == nullptr) return true;
+	int t = tileAt(p);
+	if (t < 0) return false;
+	return (row[t / 64] >> (t % 64)) & 1;
+}
+
+bool PotentiallyVisibleSet::visible(const uint64_t* row, vec2 p, float r) const {
+	if (row == nullptr) return true;
+	int x0 = max((int)floorf((p.x - r) / textureSize), 0);
+	int y0 = max((int)floorf((p.y - r) / textureSize), 0);
+	int x1 = min((int)floorf((p.x + r) / textureSize), mapSize - 1);
+	int y1 = min((int)floorf((p.y + r) / textureSize), mapSize - 1);
+	for (int y = y0; y <= y1; y++) {
+		for (int x = x0; x <= x1; x++) {
+			int t = y * mapSize + x;
+			if ((row[t / 64] >> (t % 64)) & 1) return true;
+		}
+	}
+	return false;
+}
+
+bool solidAt(float x, float y) {
+	return solidTile((int)floorf(x / textureSize), (int)floorf(y / textureSize));
+}
+
+uint32_t xorshift(uint32_t& state) {
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+float randomFloat(uint32_t& state) {
+	return (xorshift(state) >> 8) * (1.0f / (1 << 24));
+}
+
+void Game::spawnEntities(int count) {
+	uint32_t seed = 0x9e3779b9;
+	for (int i = 0; i < count; i++) {
+		vec2 p;
+		do {
+			p.x = (1 + randomFloat(seed) * (mapSize - 2)) * textureSize;
+			p.y = (1 + randomFloat(seed) * (mapSize - 2)) * textureSize;
+		} while (solidAt(p.x, p.y));
+
+		float a = randomFloat(seed) * 2 * M_PI;
+
+		Entity e;
+		e.pos = p;
+		e.next = p;
+		e.prev = p;
+		e.vel = { cosf(a) * entitySpeed, sinf(a) * entitySpeed };
+		e.radius = entityRadius;
+		e.rng = xorshift(seed) | 1;
+		e.seesPlayer = false;
+		entities.push_back(e);
+	}
+}
+
+// Grain that splits count items into a few jobs per thread of the pool, so
+// work stealing can even them out, but no smaller than minGrain.
+int splitGrain(int count, const JobSystem& jobs, int minGrain) {
+	int numJobs = (jobs.numWorkers() + 1) * 4;
+	return max((count + numJobs - 1) / numJobs, minGrain);
+}
+
+// Entity work for one tick runs as three dependent parallel loops. Each job
+// only writes the entities in its own range and only reads state that no job
+// in the same phase writes, so the result is the same for any number of
+// workers or grain.
+void Game::updateEntities() {
+	TRACE_SCOPE("updateEntities");
+	int n = (int)entities.size();
+	int grain = entityGrain > 0 ? entityGrain : splitGrain(n, jobs, minEntityGrain);
+	JobGraph::Handle move = tickGraph.parallelFor("moveEntities", n, grain, [this](int begin, int end) {
+		moveEntities(begin, end);
+	});
+	tickGraph.parallelFor("collideEntities", n, grain, [this](int begin, int end) {
+		collideEntities(begin, end);
+	}, { move });
+	jobs.run(tickGraph);
+
+	// AI needs to know who can see the player. The batch runs on the pool
+	// itself, between the collision and AI graphs.
+	// Entities outside the player's PVS cannot see them, so only the rest are
+	// traced.
+	const uint64_t* playerRow = pvs.row(pos);
+	los.newTick();
+	losQueries.clear();
+	losIndices.clear();
+	for (int i = 0; i < n; i++) {
+		entities[i].seesPlayer = false;
+		if (!pvs.visible(playerRow, entities[i].pos)) continue;
+		losQueries.push_back({ entities[i].pos, pos });
+		losIndices.push_back(i);
+	}
+	losResults.resize(losQueries.size());
+	los.queryBatch(losQueries.data(), losResults.data(), (int)losQueries.size(), jobs);
+	for (int i = 0; i < (int)losIndices.size(); i++) {
+		entities[losIndices[i]].seesPlayer = losResults[i];
+	}
+
+	tickGraph.parallelFor("thinkEntities", n, grain, [this](int begin, int end) {
+		thinkEntities(begin, end);
+	});
+	jobs.run(tickGraph);
+}
+
+void Game::moveEntities(int begin, int end) {
+	for (int i = begin; i < end; i++) {
+		Entity& e = entities[i];
+		e.prev = e.pos;
+		e.next.x = e.pos.x + e.vel.x * dt;
+		e.next.y = e.pos.y + e.vel.y * dt;
+	}
+}
+
+void Game::collideEntities(int begin, int end) {
+	for (int i = begin; i < end; i++) {
+		Entity& e = entities[i];
+
+		vec2 delta = { e.next.x - e.pos.x, e.next.y - e.pos.y };
+		vec2 n;
+		if (moveCircle(e.pos, delta, e.radius, &n, floorHeight(e.pos))) {
+			// Bounce off the wall.
+			float into = e.vel.x * n.x + e.vel.y * n.y;
+			if (into < 0) {
+				e.vel.x -= 2 * into * n.x;
+				e.vel.y -= 2 * into * n.y;
+			}
+		}
+		e.next = e.pos;
+	}
+}
+
+void Game::thinkEntities(int begin, int end) {
+	for (int i = begin; i < end; i++) {
+		Entity& e = entities[i];
+
+		float dx = pos.x - e.pos.x;
+		float dy = pos.y - e.pos.y;
+		float dist = sqrtf(dx * dx + dy * dy);
+
+		// Chase the player directly when in sight, otherwise follow the flow
+		// field around walls, and wander if the player cannot be reached.
+		vec2 flowDir = { 0, 0 };
+		if (!e.seesPlayer) {
+			flowDir = flow.direction(e.pos);
+		}
+
+		if (e.seesPlayer && dist < entitySightRange && dist > e.radius) {
+			e.vel.x = dx / dist * entitySpeed;
+			e.vel.y = dy / dist * entitySpeed;
+		}
+		else if (flowDir.x != 0 || flowDir.y != 0) {
+			e.vel.x = flowDir.x * entitySpeed;
+			e.vel.y = flowDir.y * entitySpeed;
+		}
+		else {
+			float turn = (randomFloat(e.rng) * 2 - 1) * entityWanderTurn;
+			float c = cosf(turn);
+			float s = sinf(turn);
+			e.vel = { e.vel.x * c - e.vel.y * s, e.vel.x * s + e.vel.y * c };
+		}
+	}
+}
+
+// Whether anything past distance d could still show in the window: nothing
+// there reaches higher up the screen than the top of the map at d, or the
+// horizon, nor lower down than the lowest floor at d, or the horizon.
+bool wallsCanShow(const FrameSnapshot& f, float d, int clipTop, int clipBottom) {
+	float tallest = f.camDist * (f.camZ - mapTopZ) / d + f.height / 2;
+	int highest = tallest < f.height / 2 ? (int)tallest : f.height / 2;
+	if (clipBottom <= max(highest, clipTop)) return false;
+	// Only ceilings close the window from the top.
+	if (clipTop == 0) return true;
+	float lowest = f.camDist * (f.camZ - mapBottomZ) / d + f.height / 2;
+	int lowestRow = lowest > f.height ? f.height : lowest > f.height / 2 ? (int)lowest : f.height / 2;
+	return clipTop <= lowestRow;
+}
+
+// Screen row of height z at distance d, kept to [0, height].
+int rowAt(const FrameSnapshot& f, float z, float d) {
+	float y = f.camDist * (f.camZ - z) / d + f.height / 2;
+	return y < 0 ? 0 : y > f.height ? f.height : (int)y;
+}
+
+// Queues the rows of column x between clipTop and clipBottom that show a face
+// from height zBottom up to zTop at distance d, crossed along side, with one
+// of the wall textures. y1 and y2 are set to the face's rows on screen before
+// clipping to the window.
+void Game::queueFace(const FrameSnapshot& f, int x, int texture, int side, float d, float zBottom, float zTop, int clipTop, int clipBottom, int& y1, int& y2) {
+	const int height = f.height;
+	float rDirX = columnRays.dirX[x];
+	float rDirY = columnRays.dirY[x];
+
+	float wallX;
+	if (side == 0) {
+		wallX = f.pos.y + d * rDirY;
+	}
+	else {
+		wallX = f.pos.x + d * rDirX;
+	}
+	int texSize = textures.size(texture);
+
+	//wallX -= floorf(wallX);
+	int texX = (int)(wallX * texSize / textureSize) & (texSize - 1);
+	/*if (res.side == 0 && rDirX > 0) texX = textureSize - texX - 1;
+	if (res.side == 1 && rDirX < 0) texX = textureSize - texX - 1;*/
+
+	y1 = max(f.camDist * (f.camZ - zTop) / d + height / 2, 0);
+	y2 = min((f.camZ - zBottom) * f.camDist / d + height / 2, height);
+
+	// Textures cover defaultWallHeight and sit on the ground at z = 0, so
+	// lower walls show their bottom part and taller ones repeat them.
+	float step = texSize * ((zTop - zBottom) / defaultWallHeight) / (float)(((f.camZ - zBottom) * f.camDist / d + height / 2) - (f.camDist * (f.camZ - zTop) / d + height / 2));
+	//float texY = (y1 - camZ / 2 + height / 2) * step;
+	float texY = 0;
+	if (zTop != defaultWallHeight) {
+		texY = fmodf((defaultWallHeight - zTop) * texSize / defaultWallHeight, (float)texSize);
+		if (texY < 0) texY += texSize;
+	}
+	if (y1 == 0) {
+		texY -= step * (f.camDist * (f.camZ - zTop) / d + height / 2);
+	}
+	int yStart = max(y1, clipTop);
+	int yEnd = min(y2, clipBottom);
+	texY += step * (yStart - y1);
+	if (checkerPhase >= 0) {
+		int skip = (x + yStart + checkerPhase) & 1;
+		yStart += skip;
+		texY += step * skip;
+		step *= 2;
+	}
+
+	if (yStart < yEnd) wallColumns.push_back({ x, texture, texX, yStart, yEnd, texY, step });
+}
+
+// Queues the part of the face of tile at distance d that is still open, from
+// base, the floor in front of it, up to the top of the wall.
+void Game::wallFace(const FrameSnapshot& f, int x, int tile, int side, float d, float base, int clipTop, int& clipBottom) {
+	int y1, y2;
+	queueFace(f, x, wallTexture(map[tile], side), side, d, base, mapHeights[tile], clipTop, clipBottom, y1, y2);
+	clipBottom = min(clipBottom, y1);
+	columnClips.push_back({ d, clipTop, clipBottom });
+}
+
+// Draws the top of a wall lower than the eye on tile, which the ray crosses
+// from distance dIn to dOut, like the floor at that height. Its near edge is
+// the top of the face, so it ends where that left the window.
+void Game::wallRoof(const FrameSnapshot& f, int x, int tile, float dIn, float dOut, int clipTop, int& clipBottom) {
+	const int height = f.height;
+	float rDirX = columnRays.dirX[x];
+	float rDirY = columnRays.dirY[x];
+
+	float above = f.camZ - mapHeights[tile];
+	int yFar = (int)ceilf(f.camDist * above / dOut + height / 2);
+	int yStart = max(yFar, clipTop);
+	if (yStart < clipBottom) {
+		int texture = wallTexture(map[tile], 0);
+		int yStep = checkerPhase >= 0 ? 2 : 1;
+		if (checkerPhase >= 0) yStart += (x + yStart + checkerPhase) & 1;
+		withTextureSize(textures.sizeLog(texture), [&](auto sizeLog) {
+			TextureSampler<RGB, decltype(sizeLog)::value> tex(textures, texture);
+			float scale = (float)tex.size / textureSize;
+			for (int y = yStart; y < clipBottom; y += yStep) {
+				float dist = f.camDist * above / (y - height / 2);
+				pixel(x, y) = tex.fetch((int)floorf((f.pos.x + rDirX * dist) * scale), (int)floorf((f.pos.y + rDirY * dist) * scale));
+			}
+		});
+	}
+
+	// Anything farther than its near edge, even a sprite standing partly
+	// inside the wall, is behind it.
+	clipBottom = min(clipBottom, yFar);
+	columnClips.push_back({ dIn, clipTop, clipBottom });
+}
+
+// Adds the floor and ceiling of open tile, which column x's ray crosses from
+// distance dIn to dOut (dIn 0 for the camera's own tile), to the visplanes and
+// closes the window over them.
+void Game::sectorPlanes(const FrameSnapshot& f, int x, int tile, float dIn, float dOut, int& clipTop, int& clipBottom) {
+	int top = clipTop;
+	int bottom = clipBottom;
+
+	float floor = mapFloors[tile];
+	if (floor < f.camZ) {
+		int yFar = rowAt(f, floor, dOut);
+		int yNear = dIn > 0 ? rowAt(f, floor, dIn) : f.height;
+		int y1 = max(yFar, clipTop);
+		int y2 = min(yNear, clipBottom);
+		if (y1 < y2) addPlaneRows(f, x, floor, floorTexture, y1, y2);
+		clipBottom = min(clipBottom, yFar);
+	}
+
+	float ceiling = mapCeilings[tile];
+	if (ceiling > f.camZ) {
+		int yNear = dIn > 0 ? rowAt(f, ceiling, dIn) : 0;
+		int yFar = rowAt(f, ceiling, dOut);
+		int y1 = max(yNear, clipTop);
+		int y2 = min(yFar, clipBottom);
+		if (y1 < y2) addPlaneRows(f, x, ceiling, ceilingTexture, y1, y2);
+		clipTop = max(clipTop, yFar);
+	}
+
+	if (clipTop != top || clipBottom != bottom) columnClips.push_back({ dOut, clipTop, clipBottom });
+}
+
+// Queues the faces where column x's ray goes from open tile from into open
+// tile to at distance d: a step up to a higher floor, and a ceiling coming
+// down lower. Ceilings next to open sky hang from mapTopZ, as high as the
+// tallest walls.
+void Game::sectorEdge(const FrameSnapshot& f, int x, int from, int to, int side, float d, int& clipTop, int& clipBottom) {
+	int top = clipTop;
+	int bottom = clipBottom;
+	int y1, y2;
+
+	if (mapFloors[to] > mapFloors[from]) {
+		queueFace(f, x, wallTexture(ledgeWallType, side), side, d, mapFloors[from], mapFloors[to], clipTop, clipBottom, y1, y2);
+		clipBottom = min(clipBottom, y1);
+	}
+
+	float above = mapCeilings[from] ? mapCeilings[from] : mapTopZ;
+	if (mapCeilings[to] && mapCeilings[to] < above) {
+		queueFace(f, x, wallTexture(ledgeWallType, side), side, d, mapCeilings[to], above, clipTop, clipBottom, y1, y2);
+		clipTop = max(clipTop, y2);
+	}
+
+	if (clipTop != top || clipBottom != bottom) columnClips.push_back({ d, clipTop, clipBottom });
+}
+
+// Walks the rest of column x's ray past distance d, drawing what shows over
+// the walls in front until the window closes. firstTile is the wall the ray
+// hit at d, or -1 to walk from the camera, as on maps with sectors, where the
+// floors and ceilings of the open tiles crossed and the faces between them are
+// laid out along the way too.
+void Game::wallsBehind(const FrameSnapshot& f, int x, int firstTile, float d, int& clipTop, int& clipBottom) {
+	float rDirX = columnRays.dirX[x];
+	float rDirY = columnRays.dirY[x];
+	float ahead = f.dir.x * rDirX + f.dir.y * rDirY;
+	vec2 o = { f.pos.x / textureSize, f.pos.y / textureSize };
+
+	// The solid tile the ray is in, if any, and where it went in.
+	int inTile = firstTile;
+	float dIn = d;
+	// The open tile the ray is in on maps with sectors, if any.
+	int openTile = -1;
+	if (firstTile < 0 && !solidTile((int)floorf(o.x), (int)floorf(o.y))) {
+		openTile = (int)floorf(o.y) * mapSize + (int)floorf(o.x);
+	}
+	bool hit = firstTile >= 0;
+	bool stopped = traverseMap(o, { rDirX, rDirY }, INFINITY, [&](int mapX, int mapY, float t, int side) {
+		float dCross = ahead * t * textureSize;
+		if (dCross <= d) return false;
+
+		if (inTile >= 0) {
+			if (mapHeights[inTile] < f.camZ) wallRoof(f, x, inTile, dIn, dCross, clipTop, clipBottom);
+			inTile = -1;
+		}
+		if (openTile >= 0) sectorPlanes(f, x, openTile, dIn, dCross, clipTop, clipBottom);
+		if (!wallsCanShow(f, dCross, clipTop, clipBottom)) return true;
+
+		int tile = mapY * mapSize + mapX;
+		if (map[tile] == 0) {
+			if (openTile >= 0) sectorEdge(f, x, openTile, tile, side, dCross, clipTop, clipBottom);
+			if (mapHasSectors) openTile = tile;
+			dIn = dCross;
+			return false;
+		}
+		extraWallHits += hit;
+		hit = true;
+		wallFace(f, x, tile, side, dCross, openTile >= 0 ? mapFloors[openTile] : 0, clipTop, clipBottom);
+		inTile = tile;
+		openTile = -1;
+		dIn = dCross;
+		return false;
+	});
+
+	// A tile on the edge of the map has no crossing after it.
+	int lastTile = inTile >= 0 ? inTile : openTile;
+	if (!stopped && lastTile >= 0) {
+		float tx = rDirX == 0 ? INFINITY : (lastTile % mapSize + (rDirX > 0) - o.x) / rDirX;
+		float ty = rDirY == 0 ? INFINITY : (lastTile / mapSize + (rDirY > 0) - o.y) / rDirY;
+		float dOut = ahead * fminf(tx, ty) * textureSize;
+		if (inTile < 0) sectorPlanes(f, x, openTile, dIn, dOut, clipTop, clipBottom);
+		else if (mapHeights[inTile] < f.camZ) wallRoof(f, x, inTile, dIn, dOut, clipTop, clipBottom);
+	}
+}
+
+void Game::drawWalls(const FrameSnapshot& f) {
+	TRACE_SCOPE("drawWalls");
+	const int width = f.width;
+	const int height = f.height;
+
+	columnRays.setView(f.fovX, width, f.dir.x, f.dir.y);
+
+	// Turning leaves every hit where it was, only moving it across the screen.
+	// Maps with sectors do not keep hits to reuse.
+	bool keepHits = reproject && !mapHasSectors;
+	bool reuse = keepHits && !wallHits.empty() && f.pos.x == wallHitsPos.x && f.pos.y == wallHitsPos.y;
+	reusedColumns = 0;
+	if (keepHits) nextWallHits.resize(width);
+
+	int yStep = checkerPhase >= 0 ? 2 : 1;
+	wallColumns.clear();
+	columnClips.clear();
+	columnClipStart.resize(width + 1);
+	extraWallHits = 0;
+	numVisplanes = 0;
+
+	for (int x = 0; x < width; x++) {
+		//SDL_RenderDrawLine(renderer, posx, posy, posx + (int)(dirLen * rDirX), posy + (int)(dirLen * rDirY));
+		columnClipStart[x] = (int)columnClips.size();
+
+		int clipTop = 0;
+		int clipBottom = height;
+		if (mapHasSectors) {
+			// Floors and ceilings change height anywhere along the ray, so it
+			// is walked from the camera rather than cast to its first wall.
+			wallsBehind(f, x, -1, 0, clipTop, clipBottom);
+			continue;
+		}
+
+		float rDirX = columnRays.dirX[x];
+		float rDirY = columnRays.dirY[x];
+		Raycast ray = {
+			f.pos,
+			{rDirX, rDirY}
+		};
+		RaycastResult res;
+		if (reuse && reprojectColumn(f.pos, ray.d, res)) {
+			reusedColumns++;
+		}
+		else {
+			res = raycastMap(ray);
+		}
+		if (keepHits) nextWallHits[x] = res;
+		if (res.t == -1) {
+			continue;
+		}
+
+		float d = f.dir.x * res.t * rDirX + f.dir.y * res.t * rDirY;
+		int firstTile = res.tile.y * mapSize + res.tile.x;
+		wallFace(f, x, firstTile, res.side, d, 0, clipTop, clipBottom);
+
+		// Lower walls leave the window open above them. On maps with one wall
+		// height that never happens with the eye below the walls.
+		if (wallsCanShow(f, d, clipTop, clipBottom)) {
+			wallsBehind(f, x, firstTile, d, clipTop, clipBottom);
+		}
+	}
+	columnClipStart[width] = (int)columnClips.size();
+
+	// Counting sort by texture, which keeps columns in order within a group.
+	const vector<WallColumn>* columns = &wallColumns;
+	if (groupWallsByTexture) {
+		textureStarts.assign(textures.count() + 1, 0);
+		for (const WallColumn& c : wallColumns) textureStarts[c.texture + 1]++;
+		for (size_t t = 1; t < textureStarts.size(); t++) textureStarts[t] += textureStarts[t - 1];
+		sortedWallColumns.resize(wallColumns.size());
+		for (const WallColumn& c : wallColumns) sortedWallColumns[textureStarts[c.texture]++] = c;
+		columns = &sortedWallColumns;
+	}
+
+	// Each run of columns with the same texture goes through the sampler for
+	// its size.
+	const WallColumn* c = columns->data();
+	const WallColumn* end = c + columns->size();
+	while (c != end) {
+		const WallColumn* runEnd = c + 1;
+		while (runEnd != end && runEnd->texture == c->texture) runEnd++;
+
+		withTextureSize(textures.sizeLog(c->texture), [&](auto sizeLog) {
+			TextureSampler<RGB, decltype(sizeLog)::value> tex(textures, c->texture);
+			for (; c != runEnd; c++) {
+				float texY = c->texY;
+				for (int y = c->y1; y < c->y2; y += yStep) {
+					pixel(c->x, y) = tex.fetch(c->texX, (int)texY);
+
+					texY += c->step;
+				}
+			}
+		});
+	}
+
+	if (keepHits) {
+		swap(wallHits, nextWallHits);
+		wallHitsPos = f.pos;
+		wallHitsDir = f.dir;
+		wallHitsU = columnRays.u;
+	}
+	else {
+		wallHits.clear();
+	}
+}
+
+// Slot in the textures atlas for a face of a tile with map value tile (> 0)
+// crossed along x (side 0) or y (side 1).
+int Game::wallTexture(int tile, int side) const {
+	return firstWallTexture + (tile - 1) % numWallTypes * 2 + side;
+}
+
+// Fills the floor and wall pixels a checkerboard draw skipped. With the camera
+// unchanged since the last draw they are exactly the pixels it shaded. After
+// a move the old pixel is kept only within the range of its four shaded
+// neighbours, so edges that moved do not leave ghosts; with no usable history
+// the neighbours are averaged.
+void Game::reconstruct(const FrameSnapshot& f) {
+	TRACE_SCOPE("reconstruct");
+	const int width = f.width;
+	const int height = f.height;
+
+	uint64_t camera = viewCameraHash(f);
+	checkerboard::Fill fill = checkerboard::FILL_AVERAGE;
+	if ((int)history.size() == width * height && historyCamera != 0) {
+		fill = camera == historyCamera ? checkerboard::FILL_KEEP : checkerboard::FILL_CLAMP;
+	}
+	history.resize(width * height);
+	drawSettled = fill == checkerboard::FILL_KEEP;
+
+	for (int y = 0; y < height; y++) {
+		// Off the top and bottom, the row on the other side stands in.
+		const RGB* up = &pixel(0, y > 0 ? y - 1 : y + 1);
+		const RGB* down = &pixel(0, y < height - 1 ? y + 1 : y - 1);
+		checkerboard::reconstructRow((uint8_t*)&pixel(0, y), (const uint8_t*)up, (const uint8_t*)down, (uint8_t*)&history[y * width], width, (y + checkerPhase) & 1, fill);
+	}
+
+	historyCamera = camera;
+}
+
+// Finds where the ray from pos along rayDir falls between the columns of the
+// last frame. If the columns either side of it hit the same face of the same
+// tile, the ray hits that face too, and res is set to what raycastMap would
+// return for it, to the last bit, without walking the map.
+bool Game::reprojectColumn(vec2 pos, vec2 rayDir, RaycastResult& res) const {
+	// Column x of a frame looks along dir + (dir.y, -dir.x) * u * (1 - 2x / w).
+	float along = rayDir.x * wallHitsDir.x + rayDir.y * wallHitsDir.y;
+	if (along <= 0) return false;
+	float across = rayDir.x * wallHitsDir.y - rayDir.y * wallHitsDir.x;
+	float oldX = (1 - across / along / wallHitsU) * wallHits.size() / 2;
+	if (!(oldX >= 0 && oldX < wallHits.size() - 1)) return false;
+
+	const RaycastResult& a = wallHits[(int)oldX];
+	const RaycastResult& b = wallHits[(int)oldX + 1];
+	if (a.t == -1 || b.t == -1 || a.side != b.side || a.tile.x != b.tile.x || a.tile.y != b.tile.y) return false;
+
+	float t;
+	if (!hitDistance({ pos, rayDir }, a.tile, a.side, t)) return false;
+	res = { a.tile, t, a.side };
+	return true;
+}
+
+// Top-down debug view, shown instead of the 3D view while T is toggled. It is
+// drawn straight to the SDL renderer, so it runs on the main thread.
+void Game::drawMinimap(const FrameSnapshot& f) {
+	const int width = f.width;
+	int posx = (int)(f.pos.x * textureSize);
+	int posy = (int)(f.pos.y * textureSize);
+
+	SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+	float rSize = 1;
+	float hRSize = rSize / 2;
+	SDL_Rect rect = {posx - hRSize, posy - hRSize, rSize, rSize};
+	SDL_RenderFillRect(renderer, &rect);
+
+	float dirLen = f.camDist / 10;
+	SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
+	SDL_RenderDrawLine(renderer, posx, posy, posx + (int)(dirLen * f.dir.x), posy + (int)(dirLen * f.dir.y));
+
+	SDL_SetRenderDrawColor(renderer, 255, 0, 255, 255);
+	for (int y = 0; y < mapSize; y++) {
+		for (int x = 0; x < mapSize; x++) {
+			if (map[y * mapSize + x] == 0) continue;
+			SDL_Rect rect2 = {x* textureSize, y* textureSize, textureSize, textureSize };
+			SDL_RenderFillRect(renderer, &rect2);
+		}
+	}
+
+	float u = tan(f.fovX / 2) * 2;
+	float rDirX = f.dir.x + f.dir.y * u;
+	float rDirY = f.dir.y - f.dir.x * u;
+
+	float rDirX_R = f.dir.x - f.dir.y * u;
+	float rDirY_R = f.dir.y + f.dir.x * u;
 	float rStepX = (rDirX_R - rDirX) / width;
 	float rStepY = (rDirY_R - rDirY) / width;
 
-	SDL_SetRenderDrawColor(renderer, 255, 0, 255, 255);
-	for (int y = 0; y < mapSize; y++) {
-		for (int x = 0; x < mapSize; x++) {
-			if (map[y * mapSize + x] == 0) continue;
-			SDL_Rect rect2 = {x* textureSize, y* textureSize, textureSize, textureSize };
-			SDL_RenderFillRect(renderer, &rect2);
-		}
+	SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
+	for (int x = 0; x < width; x++) {
+		RaycastResult res = raycastMap({ f.pos, {rDirX, rDirY} });
+		if (res.t != -1) {
+			SDL_RenderDrawLine(renderer, posx, posy, posx + (int)(res.t * textureSize * rDirX), posy + (int)(res.t * textureSize * rDirY));
+		}
+
+		rDirX += rStepX;
+		rDirY += rStepY;
+	}
+}
+
+const float spriteNearPlane = 1;
+
+void Game::drawSprites(const FrameSnapshot& f) {
+	TRACE_SCOPE("drawSprites");
+	const int width = f.width;
+	const int height = f.height;
+
+	drawList.assign(f.sprites.begin(), f.sprites.end());
+
+	sort(drawList.begin(), drawList.end(), [&](const Sprite& a, const Sprite& b) {
+		vec2 p = a.pos;
+		p.x -= f.pos.x;
+		p.y -= f.pos.y;
+		float da = p.x * f.dir.x + p.y * f.dir.y;
+
+		p = b.pos;
+		p.x -= f.pos.x;
+		p.y -= f.pos.y;
+		float db = p.x * f.dir.x + p.y * f.dir.y;
+
+		return da > db;
+	});
+
+	for (int i = 0; i < drawList.size(); i++) {
+		const Sprite* sprite = &drawList[i];
+		vec2 p = sprite->pos;
+
+		p.x -= f.pos.x;
+		p.y -= f.pos.y;
+
+		float sy = p.x * f.dir.x + p.y * f.dir.y;
+		float sx = p.y * f.dir.x - p.x * f.dir.y;
+
+		// Sprites right at the camera would project to enormous sizes.
+		if (sy < spriteNearPlane) {
+			continue;
+		}
+
+		float q = sx / sy;
+
+		q *= f.camDist/2;
+		q += width / 2;
+
+		/*int x1 = (int)fmaxf(q - textureSize / 2, 0);
+		int x2 = (int)fminf(q + textureSize / 2, width);*/
+
+		// Projected with the same tables drawWalls cast its rays from, so
+		// sprites line up with the depth buffer.
+		float left = columnRays.project(sx - textureSize / 2, sy);
+		float right = columnRays.project(sx + textureSize / 2, sy);
+		int x1 = (int)fmaxf(left, 0);
+		int x2 = (int)fminf(right, width);
+
+		// Sprites stand on the floor of their tile.
+		float eyeZ = f.camZ - floorHeight(sprite->pos);
+		int y1 = (int)fmaxf(f.camDist * (eyeZ - textureSize/2) / sy + height / 2, 0);
+		int y2 = (int)fminf(eyeZ * f.camDist / sy + height / 2, height);
+
+		int texSize = textures.size(spriteTexture);
+		float texX = 0;
+		float texY = 0;
+
+		float stepX = texSize / (right - left);
+		float stepY = (texSize) / (float)((eyeZ * f.camDist / sy + height / 2) - (f.camDist * (eyeZ - textureSize / 2) / sy + height / 2));
+
+		if (x1 == 0) {
+			texX -= stepX * left;
+		}
+		if (y1 == 0) {
+			texY -= stepY * (f.camDist * (eyeZ - textureSize / 2) / sy + height / 2);
+		}
+		float texY1 = texY;
+
+		withTextureSize(textures.sizeLog(spriteTexture), [&](auto sizeLog) {
+			TextureSampler<RGB, decltype(sizeLog)::value, ColourKeyedTexels> tex(textures, spriteTexture);
+			for (int x = x1; x < x2; x++) {
+				// Open rows of the column after the walls in front of the
+				// sprite.
+				int top = 0;
+				int bottom = height;
+				for (int c = columnClipStart[x]; c < columnClipStart[x + 1] && columnClips[c].depth < sy; c++) {
+					top = columnClips[c].top;
+					bottom = columnClips[c].bottom;
+				}
+				int yStart = max(y1, top);
+				int yEnd = min(y2, bottom);
+				if (yStart >= yEnd) {
+					texX += stepX;
+					texY = texY1;
+
+					continue;
+				}
+
+				texY += stepY * (yStart - y1);
+				for (int y = yStart; y < yEnd; y++) {
+					RGB colour = tex.fetch((int)texX, (int)texY);
+					if (!tex.visible(colour)) {
+						texY += stepY;
+						continue;
+					}
+					pixel(x, y) = colour;
+
+					texY += stepY;
+				}
+				texX += stepX;
+				texY = texY1;
+			}
+		});
+	}
+}
+
+RGB& Game::pixel(int x, int y) {
+	return pixelPtr[y * pixelStride + x];
+}
+
+void Game::setFovX(float f) {
+	// tan half f
+	float thf = tanf(f * 0.5);
+
+	fovX = f;
+	fovY = 2 * atanf(thf * renderHeight / renderWidth);
+	camDist = renderWidth / (2 * thf);
+	invCamDist = 1 / camDist;
+}
+
+void Game::setResolution(int w, int h) {
+	renderWidth = w;
+	renderHeight = h;
+	setFovX(fovX);
+}
+
+void Game::setPos(vec2 p) {
+	pos = p;
+}
+
+void Game::setAngle(float a) {
+	angle = a;
+	dir = { cosf(a), sinf(a) };
+}
+
+Window::Window() : frames(RenderedFrame{ vector<RGB>(windowWidth * windowHeight), 0, 0, true }), game(this) {}
+
+Window::~Window() {
+	if (screenTexture) SDL_DestroyTexture(screenTexture);
+	if (renderer) SDL_DestroyRenderer(renderer);
+	if (window) SDL_DestroyWindow(window);
+
+	SDL_Quit();
+}
+
+void Window::init() {
+	sdl_e(SDL_Init(SDL_INIT_EVERYTHING));
+
+	int scale = 1;
+	window = sdl_e(SDL_CreateWindow("Raycast Game", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, windowWidth * scale, windowHeight * scale, SDL_WINDOW_RESIZABLE));
+	renderer = sdl_e(SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC));
+
+	sdl_e(SDL_RenderSetLogicalSize(renderer, windowWidth, windowHeight));
+	//sdl_e(SDL_RenderSetIntegerScale(renderer, SDL_TRUE));
+	SDL_SetWindowMinimumSize(window, windowWidth, windowHeight);
+
+	screenTexture = sdl_e(SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING, windowWidth, windowHeight));
+
+	game.init();
+}
+
+// Sets up the game without a window or renderer, for replays and benchmarks.
+// drawFrame renders at the render resolution with no scaling.
+void Window::initHeadless() {
+	game.init();
+}
+
+void Window::drawFrame() {
+	game.writeSnapshot(view);
+	pixelBuf.resize(view.width * view.height);
+	pixelPtr = pixelBuf.data();
+	renderFrame(view, pixelPtr);
+}
+
+void Window::renderFrame(const FrameSnapshot& f, RGB* target) {
+	game.pixelPtr = target;
+	game.pixelStride = f.width;
+	memset(target, 0, f.width * f.height * sizeof(RGB));
+	game.draw(f);
+}
+
+const int upscaleBandRows = 32;
+
+// Scales a frame at the render resolution to the window, in bands of rows on
+// the job pool. Whole 2x, 3x and 4x ratios use nearest-neighbour, which keeps
+// the pixels sharp; anything else, such as the ratios dynamic resolution
+// picks, is filtered bilinearly.
+void Window::upscaleFrame(const RGB* src, int srcW, int srcH, RGB* dst) {
+	int k = windowWidth / srcW;
+	bool whole = k >= 2 && k <= 4 && srcW * k == windowWidth && srcH * k == windowHeight;
+
+	upscaleGraph.parallelFor("upscale", windowHeight, upscaleBandRows, [&](int y0, int y1) {
+		if (whole) {
+			upscale::nearest((const uint8_t*)src, srcW, srcH, (uint8_t*)dst, k, y0, y1);
+		}
+		else {
+			upscale::bilinear((const uint8_t*)src, srcW, srcH, (uint8_t*)dst, windowWidth, windowHeight, y0, y1);
+		}
+	});
+	game.jobs.run(upscaleGraph);
+}
+
+void Window::renderLoop() {
+	trace::setThreadName("render");
+	float period = 1.0f / SDL_GetPerformanceFrequency();
+	while (snapshots.waitUpdate()) {
+		TRACE_SCOPE("render");
+		const FrameSnapshot& f = snapshots.front();
+		RenderedFrame& out = frames.back();
+
+		uint64_t t0 = SDL_GetPerformanceCounter();
+		if (f.width == windowWidth && f.height == windowHeight) {
+			renderFrame(f, out.pixels.data());
+		}
+		else {
+			renderBuf.resize(f.width * f.height);
+			renderFrame(f, renderBuf.data());
+			upscaleFrame(renderBuf.data(), f.width, f.height, out.pixels.data());
+		}
+		out.renderTime = (SDL_GetPerformanceCounter() - t0) * period;
+		out.view = viewHash(f);
+		out.settled = game.drawSettled;
+
+		frames.publish();
+	}
+}
+
+void Window::setResolution(int w, int h) {
+	baseWidth = w;
+	baseHeight = h;
+	resolutionScale = 1;
+	game.setResolution(w, h);
+}
+
+const float minResolutionScale = 0.5f;
+
+// Called with the render time of each finished frame. The scale drops quickly
+// when a frame goes over budget and creeps back up while there is plenty of
+// headroom, so it settles instead of oscillating.
+void Window::adjustResolution(float renderTime) {
+	if (renderTime > targetFrameTime * 0.9f) resolutionScale *= 0.9f;
+	else if (renderTime < targetFrameTime * 0.7f) resolutionScale *= 1.02f;
+	resolutionScale = fminf(fmaxf(resolutionScale, minResolutionScale), 1);
+
+	int w = max((int)(baseWidth * resolutionScale), 1);
+	int h = max(w * baseHeight / baseWidth, 1);
+	if (w != game.renderWidth || h != game.renderHeight) game.setResolution(w, h);
+}
+
+// Copies the latest game state into the snapshot buffer for the render thread,
+// unless the last one published already looks the same. The exception is a
+// checkerboard frame drawn as the camera stopped, which is partly estimated:
+// the same view is published once more so the render thread shades the other
+// half, rather than leaving the estimate on screen while the view is idle.
+void Window::publishSnapshot(float alpha) {
+	game.writeSnapshot(view, alpha);
+	uint64_t hash = viewHash(view);
+	if (hash == publishedView && publishedView != 0) {
+		const RenderedFrame& shown = frames.front();
+		if (shown.view != hash || shown.settled || settleRequested) return;
+		settleRequested = true;
+	}
+	publishedView = hash;
+	snapshots.back() = view;
+	snapshots.publish();
+}
+
+bool firstPerson = true;
+void Window::run() {
+	float period = 1.0f / SDL_GetPerformanceFrequency();
+	uint64_t t0 = SDL_GetPerformanceCounter();
+
+	publishSnapshot();
+	thread renderThread([this] { renderLoop(); });
+	// Last tick given a frame in the capture, and whether the render thread
+	// has delivered any frame yet.
+	int64_t capturedTick = (int64_t)game.tick - 1;
+	bool haveFrame = false;
+
+	while (gameRunning) {
+		TRACE_SCOPE("frame");
+
+		lastTime = time;
+		uint64_t now = SDL_GetPerformanceCounter();
+		time = (now - t0) * period;
+
+		timeAccumulator += time - lastTime;
+
+		{
+			TRACE_SCOPE("events");
+			SDL_Event e;
+			while (SDL_PollEvent(&e)) {
+				switch (e.type) {
+				case SDL_QUIT:
+					gameRunning = false;
+					break;
+				case SDL_MOUSEMOTION:
+					mouseRelX += e.motion.xrel;
+					break;
+				}
+			}
+
+			lastKeystate = keyState;
+
+			int numKeys;
+			const uint8_t* keyStatePtr = SDL_GetKeyboardState(&numKeys);
+			keyState.resize(numKeys);
+			copy(keyStatePtr, keyStatePtr + numKeys, keyState.begin());
+		}
+
+		int ticks = 0;
+		while (timeAccumulator > dt && ticks < maxTicksPerFrame) {
+			timeAccumulator -= dt;
+			game.input = sampleInput();
+			if (recorder) recorder->write(game.input);
+			game.update();
+			ticks++;
+		}
+		// Drop whatever could not be caught up on rather than carrying it over.
+		if (timeAccumulator > dt) timeAccumulator = fmodf(timeAccumulator, dt);
+		//cout << "FRAME\n";
+
+		// Published every frame, even without a tick, because the camera is
+		// drawn part of the way between the last two ticks.
+		publishSnapshot(timeAccumulator / dt);
+
+		SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+		SDL_RenderClear(renderer);
+
+		if (frames.update()) {
+			TRACE_SCOPE("upload");
+			settleRequested = false;
+			haveFrame = true;
+			sdl_e(SDL_UpdateTexture(screenTexture, nullptr, frames.front().pixels.data(), windowWidth * sizeof(RGB)));
+			if (dynamicResolution) adjustResolution(frames.front().renderTime);
+		}
+
+		// One frame per simulated tick keeps the video at the simulation rate
+		// however fast the display refreshes. Ticks that got no new frame,
+		// because the view was unchanged or rendering fell behind, repeat the
+		// one on show.
+		if (capture && haveFrame) {
+			for (; capturedTick < (int64_t)game.tick; capturedTick++) {
+				capture->submit(frames.front().pixels.data());
+			}
+		}
+		if (keyPressed(SDL_SCANCODE_T)) {
+			firstPerson = !firstPerson;
+		}
+		if (firstPerson) SDL_RenderCopy(renderer, screenTexture, nullptr, nullptr);
+		else game.drawMinimap(view);
+
+		if (keyPressed(SDL_SCANCODE_ESCAPE)) {
+			SDL_SetRelativeMouseMode((SDL_bool)!SDL_GetRelativeMouseMode());
+		}
+
+		uint64_t frameEnd = SDL_GetPerformanceCounter();
+		float frameTime = (frameEnd - now) * period;
+		//cout << frameTime * 1000 << "\n";
+
+		TRACE_SCOPE("present");
+		SDL_RenderPresent(renderer);
+	}
+
+	snapshots.close();
+	renderThread.join();
+
+	if (capture) {
+		capture->finish();
+		fprintf(stderr, "captured %d frames, dropped %d\n", capture->framesWritten(), capture->framesDropped());
+	}
+}
+
+bool Window::keyDown(int key) {
+	return keyState[key];
+}
+
+bool Window::keyPressed(int key) {
+	return keyState[key] && !lastKeystate[key];
+}
+
+// Takes the current keyboard state and any mouse motion not yet given to a
+// tick. If several ticks run in one frame only the first sees the motion.
+InputFrame Window::sampleInput() {
+	InputFrame in = { 0, 0 };
+	for (int i = 0; i < numInputKeys; i++) {
+		if (keyDown(inputKeys[i])) in.keys |= 1 << i;
 	}
+	in.mouseRelX = (int16_t)max(min(mouseRelX, INT16_MAX), INT16_MIN);
+	mouseRelX = 0;
+	return in;
+}
 
-	SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-	for (int x = 0; x < width; x++) {
-		SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-		//SDL_RenderDrawLine(renderer, posx, posy, posx + (int)(dirLen * rDirX), posy + (int)(dirLen * rDirY));
+// Runs a recording through Game::update without a window, drawing every tick
+// unless draw is false. Prints hashes of the camera path and of the frames to
+// standard error, so two runs can be compared, and optionally writes the
+// camera path as CSV.
+struct ReplayOptions {
+	bool draw = true;
+	const char* csvPath = nullptr;
+	const char* capturePath = nullptr;
+	bool reproject = false;
+	bool checkerboard = false;
+};
 
-		Raycast ray = {
-			pos,
-			{rDirX, rDirY}
-		};
-		RaycastResult res = raycastMap(ray);
-		if (res.t == -1) {
-			rDirX += rStepX;
-			rDirY += rStepY;
-			continue;
-		}
+void replayInput(const char* path, const ReplayOptions& options) {
+	InputReplay replay(path);
+	bool draw = options.draw;
+	const char* csvPath = options.csvPath;
+	const char* capturePath = options.capturePath;
+
+	Window window;
+	window.initHeadless();
+	Game& game = window.game;
+	game.reproject = options.reproject;
+	game.checkerboard = options.checkerboard;
+
+	// Offline, so waiting for the writer is fine and no frame is dropped.
+	unique_ptr<VideoCapture> capture;
+	if (draw && capturePath) capture = make_unique<VideoCapture>(capturePath, game.renderWidth, game.renderHeight, FPS);
+
+	ofstream csv;
+	if (csvPath) {
+		csv.open(csvPath);
+		if (!csv) throw runtime_error(string("Cannot write ") + csvPath);
+		csv << "tick,x,y,angle,camZ,fovX\n";
+	}
+
+	uint64_t cameraHash = fnvBasis;
+	uint64_t frameHash = fnvBasis;
+
+	float period = 1.0f / SDL_GetPerformanceFrequency();
+	uint64_t t0 = SDL_GetPerformanceCounter();
 
-		float d = dir.x * res.t * rDirX + dir.y * res.t * rDirY;
-		window->depthBuf[x] = d;
+	while (replay.read(game.input)) {
+		game.update();
 
-		float wallX;
-		if (res.side == 0) {
-			wallX = pos.y + d * rDirY;
+		float camera[] = { game.pos.x, game.pos.y, game.angle, game.camZ, game.fovX };
+		cameraHash = fnv1a(cameraHash, camera, sizeof(camera));
+		if (csv.is_open()) {
+			csv << game.tick << "," << camera[0] << "," << camera[1] << "," << camera[2] << "," << camera[3] << "," << camera[4] << "\n";
 		}
-		else {
-			wallX = pos.x + d * rDirX;
+
+		if (draw) {
+			window.drawFrame();
+			frameHash = fnv1a(frameHash, window.pixelPtr, window.pixelBuf.size() * sizeof(RGB));
+			if (capture) capture->submit(window.pixelPtr, true);
 		}
-		//wallX -= floorf(wallX);
-		int texX = (int)(wallX * 1) % textureSize;
-		/*if (res.side == 0 && rDirX > 0) texX = textureSize - texX - 1;
-		if (res.side == 1 && rDirX < 0) texX = textureSize - texX - 1;*/
+	}
 
-		SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
-		SDL_RenderDrawLine(renderer, posx, posy, posx + (int)(res.t * textureSize * rDirX), posy + (int)(res.t * textureSize * rDirY));
+	float elapsed = (SDL_GetPerformanceCounter() - t0) * period;
 
-		RGB colours[] = { {255, 0, 0}, {200, 0, 0} };
-		RGB colour = colours[res.side];
+	// The capture may be going to standard output, so the report goes to
+	// standard error once it has been written out.
+	if (capture) capture->finish();
+	fprintf(stderr, "ticks: %u\n", game.tick);
+	fprintf(stderr, "camera hash: %016llx\n", (unsigned long long)cameraHash);
+	if (draw) fprintf(stderr, "frame hash: %016llx\n", (unsigned long long)frameHash);
+	fprintf(stderr, "time: %.3f s (%.3f ms/tick)\n", elapsed, game.tick ? elapsed / game.tick * 1e3f : 0.0f);
+	if (capture) fprintf(stderr, "captured %d frames, dropped %d\n", capture->framesWritten(), capture->framesDropped());
+}
 
-		float wallHeight = 32;
-		int y1 = max(camDist * (camZ - wallHeight) / d + height / 2, 0);
-		int y2 = min(camZ * camDist / d + height / 2, height);
+// Moves numMovers circles around the level for a number of ticks, first on one
+// thread and then split across the job pool, and reports the cost per mover.
+void benchCollision(const Level& level, int numMovers, int ticks) {
+	useLevelMap(level);
+
+	vector<CircleMove> initial(numMovers);
+	uint32_t seed = 12345;
+	for (CircleMove& m : initial) {
+		do {
+			m.pos.x = randomFloat(seed) * mapSize * textureSize;
+			m.pos.y = randomFloat(seed) * mapSize * textureSize;
+		} while (solidAt(m.pos.x, m.pos.y));
+
+		float a = randomFloat(seed) * 2 * M_PI;
+		m.delta = { cosf(a) * speed * dt, sinf(a) * speed * dt };
+		m.radius = entityRadius;
+	}
 
-		float step = textureSize / (float)((camZ * camDist / d + height / 2) - (camDist * (camZ - wallHeight) / d + height / 2));
-		//float texY = (y1 - camZ / 2 + height / 2) * step;
-		float texY = 0;
-		if (y1 == 0) {
-			texY -= step * (camDist * (camZ - wallHeight) / d + height / 2);
+	auto tick = [](CircleMove* moves, int count) {
+		moveCircles(moves, count);
+		for (int i = 0; i < count; i++) {
+			CircleMove& m = moves[i];
+			if (!m.hit) continue;
+			float into = m.delta.x * m.normal.x + m.delta.y * m.normal.y;
+			if (into < 0) {
+				m.delta.x -= 2 * into * m.normal.x;
+				m.delta.y -= 2 * into * m.normal.y;
+			}
 		}
-		for (int y = y1; y < y2; y++) {
-			pixel(x, y) = texture2[(((int)texY) & (textureSize - 1)) * textureSize + texX];
+	};
+
+	float period = 1.0f / SDL_GetPerformanceFrequency();
+
+	vector<CircleMove> serial = initial;
+	uint64_t t0 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < ticks; i++) {
+		tick(serial.data(), numMovers);
+	}
+	float serialTime = (SDL_GetPerformanceCounter() - t0) * period;
+
+	JobSystem jobs;
+	JobGraph graph;
+	vector<CircleMove> parallel = initial;
+	t0 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < ticks; i++) {
+		graph.parallelFor("moveCircles", numMovers, splitGrain(numMovers, jobs, minEntityGrain), [&](int begin, int end) {
+			tick(parallel.data() + begin, end - begin);
+		});
+		jobs.run(graph);
+	}
+	float parallelTime = (SDL_GetPerformanceCounter() - t0) * period;
+
+	bool same = true;
+	for (int i = 0; i < numMovers; i++) {
+		same &= serial[i].pos.x == parallel[i].pos.x && serial[i].pos.y == parallel[i].pos.y;
+	}
+
+	float moves = (float)numMovers * ticks;
+	printf("collision: %s, %d movers, %d ticks\n", level.name.c_str(), numMovers, ticks);
+	printf("  serial:   %.1f ns/mover, %.3f ms/tick\n", serialTime / moves * 1e9f, serialTime / ticks * 1e3f);
+	printf("  parallel: %.1f ns/mover, %.3f ms/tick (%d threads)\n", parallelTime / moves * 1e9f, parallelTime / ticks * 1e3f, jobs.numWorkers() + 1);
+	printf("  results %s\n", same ? "match" : "DIFFER");
+}
+
+// Runs the simulation of a level with numEntities entities for a number of
+// ticks, once with every entity phase as a single job and once split across
+// the job pool, and reports the cost per entity and whether both agree.
+void benchEntities(const Level& level, int numEntities, int ticks) {
+	float period = 1.0f / SDL_GetPerformanceFrequency();
+
+	auto simulate = [&](Window& window, bool split, float& time) {
+		Game& game = window.game;
+		game.level = level;
+		window.initHeadless();
+		game.entities.clear();
+		game.spawnEntities(numEntities);
+		game.entityGrain = split ? 0 : max(numEntities, 1);
 
-			texY += step;
+		uint64_t t0 = SDL_GetPerformanceCounter();
+		for (int i = 0; i < ticks; i++) {
+			game.update();
 		}
+		time = (SDL_GetPerformanceCounter() - t0) * period;
+	};
 
-		rDirX += rStepX;
-		rDirY += rStepY;
+	float serialTime;
+	Window serial;
+	simulate(serial, false, serialTime);
+
+	float parallelTime;
+	Window parallel;
+	simulate(parallel, true, parallelTime);
+
+	bool same = true;
+	for (int i = 0; i < numEntities; i++) {
+		const Entity& a = serial.game.entities[i];
+		const Entity& b = parallel.game.entities[i];
+		same &= a.pos.x == b.pos.x && a.pos.y == b.pos.y && a.vel.x == b.vel.x && a.vel.y == b.vel.y;
 	}
+
+	const JobSystem& jobs = parallel.game.jobs;
+	int grain = splitGrain(numEntities, jobs, minEntityGrain);
+	float updates = (float)numEntities * ticks;
+	printf("entities: %s, %d entities, %d ticks\n", level.name.c_str(), numEntities, ticks);
+	printf("  one job:  %.1f ns/entity, %.3f ms/tick\n", serialTime / updates * 1e9f, serialTime / ticks * 1e3f);
+	printf("  split:    %.1f ns/entity, %.3f ms/tick (%d jobs per phase, %d threads)\n", parallelTime / updates * 1e9f, parallelTime / ticks * 1e3f, (numEntities + grain - 1) / grain, jobs.numWorkers() + 1);
+	printf("  results %s\n", same ? "match" : "DIFFER");
 }
 
-void Game::drawSprites() {
-	sort(sprites.begin(), sprites.end(), [&](const Sprite& a, const Sprite& b) {
-		vec2 p = a.pos;
-		p.x -= pos.x;
-		p.y -= pos.y;
-		float da = p.x * dir.x + p.y * dir.y;
+// Camera pose along a path at time t, interpolated between keys.
+CameraKey sampleCameraPath(const vector<CameraKey>& path, float t) {
+	if (t <= path.front().time) return path.front();
+	if (t >= path.back().time) return path.back();
+
+	size_t i = 1;
+	while (path[i].time < t) i++;
+	const CameraKey& a = path[i - 1];
+	const CameraKey& b = path[i];
+	float f = b.time > a.time ? (t - a.time) / (b.time - a.time) : 1;
+
+	// Turn the short way round.
+	float da = fmodf(b.angle - a.angle, 360);
+	if (da > 180) da -= 360;
+	if (da < -180) da += 360;
+
+	CameraKey k;
+	k.time = t;
+	k.pos = { lerp(a.pos.x, b.pos.x, f), lerp(a.pos.y, b.pos.y, f) };
+	k.angle = a.angle + da * f;
+	k.fov = lerp(a.fov, b.fov, f);
+	k.z = lerp(a.z, b.z, f);
+	return k;
+}
 
-		p = b.pos;
-		p.x -= pos.x;
-		p.y -= pos.y;
-		float db = p.x * dir.x + p.y * dir.y;
+struct FrameStats {
+	float mean;
+	float p50;
+	float p95;
+	float p99;
+};
 
-		return da > db;
-	});
+FrameStats frameStats(vector<float> samples) {
+	FrameStats s = { 0, 0, 0, 0 };
+	if (samples.empty()) return s;
 
-	for (int i = 0; i < sprites.size(); i++) {
-		const Sprite* sprite = &sprites[i];
-		vec2 p = sprite->pos;
+	sort(samples.begin(), samples.end());
+	double sum = 0;
+	for (float x : samples) sum += x;
+	s.mean = (float)(sum / samples.size());
+
+	// Nearest-rank percentiles.
+	auto rank = [&](float p) {
+		size_t i = (size_t)ceilf(p * samples.size());
+		return samples[i > 0 ? i - 1 : 0];
+	};
+	s.p50 = rank(0.50f);
+	s.p95 = rank(0.95f);
+	s.p99 = rank(0.99f);
+	return s;
+}
+
+void writeStatsJson(ostream& out, const char* name, const FrameStats& s, bool last) {
+	out << "        \"" << name << "\": { \"mean\": " << s.mean << ", \"p50\": " << s.p50
+		<< ", \"p95\": " << s.p95 << ", \"p99\": " << s.p99 << " }" << (last ? "\n" : ",\n");
+}
+
+// Mean hardware counts per frame, plus instructions per cycle.
+void writePerfJson(ostream& out, const char* name, const PerfSample& total, int frames, bool last) {
+	out << "        \"" << name << "\": { ";
+	for (int e = 0; e < numPerfEvents; e++) {
+		out << "\"" << perfEventNames[e] << "\": " << (double)total.count[e] / frames << ", ";
+	}
+	double cycles = (double)total.count[PERF_CYCLES];
+	out << "\"ipc\": " << (cycles > 0 ? total.count[PERF_INSTRUCTIONS] / cycles : 0) << " }" << (last ? "\n" : ",\n");
+}
+
+struct Resolution {
+	int width;
+	int height;
+};
+
+// Internal resolutions the camera path benchmark renders at.
+const Resolution benchResolutions[] = {
+	{ 320, 180 },
+	{ 640, 360 },
+	{ 1280, 720 },
+	{ 1920, 1080 },
+};
 
-		p.x -= pos.x;
-		p.y -= pos.y;
+const int benchWarmupFrames = 30;
 
-		float sy = p.x * dir.x + p.y * dir.y;
-		float sx = p.y * dir.x - p.x * dir.y;
+// Flies the scripted camera path of each level through Game::draw at each
+// benchmark resolution and writes per-stage frame time statistics, in
+// milliseconds, as JSON.
+void benchCameraPath(const vector<string>& levelPaths, bool checkerboard, ostream& out) {
+	float period = 1.0f / SDL_GetPerformanceFrequency();
+
+	out << fixed;
+	out.precision(4);
+	out << "{\n  \"benchmark\": \"camera-path\",\n  \"results\": [\n";
 
-		if (sy < 0) {
+	bool first = true;
+	for (const string& levelPath : levelPaths) {
+		Level level = levelPath == "default" ? defaultLevel() : loadLevel(levelPath.c_str());
+		if (level.path.empty()) {
+			cerr << level.name << " has no camera path, skipping\n";
 			continue;
 		}
 
-		float q = sx / sy;
+		for (const Resolution& res : benchResolutions) {
+			Window window;
+			window.game.level = level;
+			window.setResolution(res.width, res.height);
+			window.initHeadless();
+			Game& game = window.game;
+			game.checkerboard = checkerboard;
+
+			int frames = (int)(level.path.back().time * FPS) + 1;
+			vector<float> samples[numRenderStages + 1];
+			PerfSample perfTotal[numRenderStages] = {};
+
+			for (int i = -benchWarmupFrames; i < frames; i++) {
+				CameraKey k = sampleCameraPath(level.path, max(i, 0) * dt);
+				game.setPos({ k.pos.x * textureSize, k.pos.y * textureSize });
+				game.setAngle(degToRad(k.angle));
+				game.setFovX(degToRad(k.fov));
+				game.camZ = k.z;
+
+				uint64_t t0 = SDL_GetPerformanceCounter();
+				window.drawFrame();
+				uint64_t t1 = SDL_GetPerformanceCounter();
+				if (i < 0) continue;
+
+				for (int s = 0; s < numRenderStages; s++) {
+					samples[s].push_back(game.stageTime[s] * period * 1000);
+					if (perfCounters) {
+						for (int e = 0; e < numPerfEvents; e++) perfTotal[s].count[e] += game.stagePerf[s].count[e];
+					}
+				}
+				samples[numRenderStages].push_back((t1 - t0) * period * 1000);
+			}
 
-		printf("%f %f\n", sx, sy);
+			if (!first) out << ",\n";
+			first = false;
+
+			out << "    {\n";
+			out << "      \"level\": \"" << level.name << "\",\n";
+			out << "      \"width\": " << res.width << ",\n";
+			out << "      \"height\": " << res.height << ",\n";
+			out << "      \"checkerboard\": " << (checkerboard ? "true" : "false") << ",\n";
+			out << "      \"frames\": " << frames << ",\n";
+			out << "      \"stages\": {\n";
+			for (int s = 0; s < numRenderStages; s++) {
+				writeStatsJson(out, renderStageNames[s], frameStats(samples[s]), false);
+			}
+			writeStatsJson(out, "frame", frameStats(samples[numRenderStages]), true);
+			out << "      }";
+			if (perfCounters) {
+				out << ",\n      \"counters\": {\n";
+				for (int s = 0; s < numRenderStages; s++) {
+					writePerfJson(out, renderStageNames[s], perfTotal[s], frames, s == numRenderStages - 1);
+				}
+				out << "      }";
+			}
+			out << "\n    }";
+		}
+	}
 
-		q *= camDist/2;
-		q += width / 2;
+	out << "\n  ]\n}\n";
+}
 
-		/*int x1 = (int)fmaxf(q - textureSize / 2, 0);
-		int x2 = (int)fminf(q + textureSize / 2, width);*/
+// Fills the map with a random size x size level: solid border and a fraction
+// of the inside tiles solid.
+// Walls get random values from 1 to values.
+void makeSyntheticMap(int size, float density, uint32_t seed, int values = 1) {
+	mapSize = size;
+	map.assign(size * size, 0);
+	mapHeights.assign(size * size, defaultWallHeight);
+	mapFloors.assign(size * size, 0);
+	mapCeilings.assign(size * size, 0);
+	for (int y = 0; y < size; y++) {
+		for (int x = 0; x < size; x++) {
+			bool border = x == 0 || y == 0 || x == size - 1 || y == size - 1;
+			if (border || randomFloat(seed) < density) {
+				map[y * size + x] = values > 1 ? 1 + xorshift(seed) % values : 1;
+			}
+		}
+	}
+	measureMap();
+}
 
-		int x1 = (int)fmaxf((sx - textureSize/2) / sy * camDist/2 + width / 2, 0);
-		int x2 = (int)fminf((sx + textureSize/2) / sy * camDist / 2 + width / 2, width);
+const int microWarmup = 3;
+const int microReps = 15;
 
-		int y1 = (int)fmaxf(camDist * (camZ - textureSize/2) / sy + height / 2, 0);
-		int y2 = (int)fminf(camZ * camDist / sy + height / 2, height);
+volatile float microSink;
 
-		float texX = 0;
-		float texY = 0;
+// Runs fn warmup times untimed, then reps times, and prints the time per unit
+// of work (fn does `units` of them per call) as median, mean, standard
+// deviation and minimum over the repetitions.
+template <class F>
+void microbench(const string& name, const char* unit, double units, F fn) {
+	float period = 1.0f / SDL_GetPerformanceFrequency();
 
-		float stepX = (textureSize) / (float)(((sx + textureSize / 2) / sy * camDist / 2 + width / 2) - ((sx - textureSize / 2) / sy * camDist / 2 + width / 2));
-		float stepY = (textureSize) / (float)((camZ * camDist / sy + height / 2) - (camDist * (camZ - textureSize / 2) / sy + height / 2));
+	for (int i = 0; i < microWarmup; i++) fn();
+
+	vector<double> ns;
+	PerfSample perfTotal = {};
+	for (int i = 0; i < microReps; i++) {
+		PerfSample p0 = {};
+		if (perfCounters) p0 = perfCounters->read();
+		uint64_t t0 = SDL_GetPerformanceCounter();
+		fn();
+		uint64_t t1 = SDL_GetPerformanceCounter();
+		if (perfCounters) {
+			PerfSample d = perfCounters->read() - p0;
+			for (int e = 0; e < numPerfEvents; e++) perfTotal.count[e] += d.count[e];
+		}
+		ns.push_back((t1 - t0) * (double)period * 1e9 / units);
+	}
 
-		if (x1 == 0) {
-			texX -= stepX * ((sx - textureSize / 2) / sy * camDist / 2 + width / 2);
+	sort(ns.begin(), ns.end());
+	double mean = 0;
+	for (double x : ns) mean += x;
+	mean /= ns.size();
+	double var = 0;
+	for (double x : ns) var += (x - mean) * (x - mean);
+	double stddev = sqrt(var / (ns.size() - 1));
+
+	printf("%-40s %9.2f ns/%-6s (mean %.2f +- %.2f, min %.2f)\n", name.c_str(), ns[ns.size() / 2], unit, mean, stddev, ns[0]);
+
+	if (perfCounters) {
+		double n = units * microReps;
+		double cycles = (double)perfTotal.count[PERF_CYCLES];
+		double instructions = (double)perfTotal.count[PERF_INSTRUCTIONS];
+		printf("%-40s %9.2f cycles, %.2f instructions (IPC %.2f), %.3f cache misses, %.3f branch misses per %s\n", "",
+			cycles / n, instructions / n, cycles > 0 ? instructions / cycles : 0,
+			perfTotal.count[PERF_CACHE_MISSES] / n, perfTotal.count[PERF_BRANCH_MISSES] / n, unit);
+	}
+}
+
+// Double precision, with every boundary crossing computed from the origin
+// rather than accumulated. Only used to judge the accuracy of the others.
+RaycastResult raycastMapReference(Raycast r) {
+	double ox = (double)r.o.x / textureSize;
+	double oy = (double)r.o.y / textureSize;
+	double dx = r.d.x;
+	double dy = r.d.y;
+	int mapX = (int)floor(ox);
+	int mapY = (int)floor(oy);
+	int stepX = dx > 0 ? 1 : -1;
+	int stepY = dy > 0 ? 1 : -1;
+	int nextX = mapX + (stepX == 1);
+	int nextY = mapY + (stepY == 1);
+
+	while (true) {
+		double tx = dx != 0 ? (nextX - ox) / dx : INFINITY;
+		double ty = dy != 0 ? (nextY - oy) / dy : INFINITY;
+		if (tx == INFINITY && ty == INFINITY) break;
+		double t;
+		int side;
+		if (tx < ty) {
+			t = tx;
+			mapX += stepX;
+			nextX += stepX;
+			side = 0;
 		}
-		if (y1 == 0) {
-			texY -= stepY * (camDist * (camZ - textureSize / 2) / sy + height / 2);
+		else {
+			t = ty;
+			mapY += stepY;
+			nextY += stepY;
+			side = 1;
 		}
-		float texY1 = texY;
 
-		for (int x = x1; x < x2; x++) {
-			if (window->depthBuf[x] < sy) {
-				texX += stepX;
-				texY = texY1;
+		if (mapX < 0 || mapX > mapSize - 1 || mapY < 0 || mapY > mapSize - 1) break;
+		if (map[mapY * mapSize + mapX] != 0) return { {mapX, mapY}, (float)(t * textureSize), side };
+	}
 
-				continue;
+	return { {0, 0}, -1, 0 };
+}
+
+void benchRaycast() {
+	const int numRays = 1 << 16;
+	const int sizes[] = { 16, 64, 256 };
+	const float densities[] = { 0.05f, 0.3f };
+
+	for (int size : sizes) {
+		for (float density : densities) {
+			makeSyntheticMap(size, density, 1234);
+
+			uint32_t seed = 99;
+			vector<Raycast> rays(numRays);
+			for (Raycast& r : rays) {
+				do {
+					r.o.x = randomFloat(seed) * size * textureSize;
+					r.o.y = randomFloat(seed) * size * textureSize;
+				} while (solidAt(r.o.x, r.o.y));
+				float a = randomFloat(seed) * 2 * M_PI;
+				r.d = { cosf(a), sinf(a) };
 			}
 
-			for (int y = y1; y < y2; y++) {
-				RGB colour = barrelTexture[(((int)texY) & (textureSize - 1)) * textureSize + texX];
-				if (colour.r == 255 && colour.g == 0 && colour.b == 255) {
-					texY += stepY;
-					continue;
+			vector<RaycastResult> reference(numRays);
+			for (int i = 0; i < numRays; i++) reference[i] = raycastMapReference(rays[i]);
+
+			struct Variant {
+				const char* name;
+				RaycastResult (*cast)(Raycast);
+			};
+			const Variant variants[] = { { "raycastMapFloat", raycastMapFloat }, { "raycastMapFixed", raycastMapFixed } };
+			for (const Variant& v : variants) {
+				string name = string(v.name) + " " + to_string(size) + "x" + to_string(size) + " fill " + to_string((int)(density * 100)) + "%";
+				microbench(name, "ray", numRays, [&] {
+					float sum = 0;
+					for (const Raycast& r : rays) sum += v.cast(r).t;
+					microSink = sum;
+				});
+
+				// Rays that hit a different tile face than the reference, and
+				// the largest distance error among the rest, in world units.
+				int wrong = 0;
+				float maxError = 0;
+				for (int i = 0; i < numRays; i++) {
+					RaycastResult a = v.cast(rays[i]);
+					const RaycastResult& b = reference[i];
+					if (a.tile.x != b.tile.x || a.tile.y != b.tile.y || a.side != b.side || (a.t == -1) != (b.t == -1)) wrong++;
+					else maxError = fmaxf(maxError, fabsf(a.t - b.t));
 				}
-				pixel(x, y) = colour;
-
-				texY += stepY;
+				printf("%-40s %9.4f%% wrong hits, max distance error %.2g\n", "", 100.0 * wrong / numRays, maxError);
 			}
-			texX += stepX;
-			texY = texY1;
 		}
 	}
 }
 
-RGB& Game::pixel(int x, int y) {
-	return pixelPtr[y * width + x];
+void benchFloor(Window& window) {
+	Game& game = window.game;
+	const float camZs[] = { 8, 16, 48 };
+	const float fovs[] = { 50, 70, 100 };
+	double pixels = (double)game.renderWidth * (game.renderHeight - game.renderHeight / 2);
+
+	for (float camZ : camZs) {
+		for (float fov : fovs) {
+			game.camZ = camZ;
+			game.setFovX(degToRad(fov));
+			FrameSnapshot f;
+			game.writeSnapshot(f);
+			string name = "drawFloor camZ " + to_string((int)camZ) + " fov " + to_string((int)fov);
+			microbench(name, "pixel", pixels, [&] {
+				game.drawFloor(f);
+			});
+		}
+	}
+
+	game.camZ = HEIGHT;
+	game.setFovX(degToRad(70));
 }
 
-const float invAspectRatio = height / width;
-void Game::setFovX(float f) {
-	// tan half f
-	float thf = tanf(f * 0.5);
+// Turning on the spot at keyboard speed, so with reprojection on most columns
+// are reused from the frame before.
+void benchWalls(Window& window) {
+	Game& game = window.game;
+	FrameSnapshot f;
+	game.writeSnapshot(f);
+
+	for (int reproject = 0; reproject < 2; reproject++) {
+		game.reproject = reproject;
+		game.wallHits.clear();
+		int columns = 0;
+		int reused = 0;
+		string name = reproject ? "drawWalls turning, reprojected" : "drawWalls turning";
+		microbench(name, "column", f.width, [&] {
+			f.angle += turnSpeed * dt;
+			f.dir = { cosf(f.angle), sinf(f.angle) };
+			game.drawWalls(f);
+			columns += f.width;
+			reused += game.reusedColumns;
+		});
+		if (reproject) printf("%-40s %9.1f%% of columns reused\n", "", 100.0f * reused / columns);
+	}
+	game.reproject = false;
+	game.wallHits.clear();
+}
 
-	fovX = f;
-	fovY = 2 * atanf(thf * invAspectRatio);
-	camDist = width / (2 * thf);
-	invCamDist = 1 / camDist;
+// Views over a map using every wall texture, so neighbouring columns often
+// switch between them.
+void benchWallTextures(Window& window) {
+	Game& game = window.game;
+	makeSyntheticMap(64, 0.3f, 4321, numWallTypes);
+
+	uint32_t seed = 17;
+	vector<FrameSnapshot> views(16);
+	for (FrameSnapshot& f : views) {
+		game.writeSnapshot(f);
+		do {
+			f.pos = { (1 + randomFloat(seed) * 62) * textureSize, (1 + randomFloat(seed) * 62) * textureSize };
+		} while (map[(int)(f.pos.y / textureSize) * mapSize + (int)(f.pos.x / textureSize)]);
+		f.angle = randomFloat(seed) * 2 * M_PI;
+		f.dir = { cosf(f.angle), sinf(f.angle) };
+	}
+
+	for (int grouped = 1; grouped >= 0; grouped--) {
+		game.groupWallsByTexture = grouped;
+		string name = grouped ? "drawWalls textures, grouped" : "drawWalls textures, in column order";
+		microbench(name, "column", (double)views[0].width * views.size(), [&] {
+			for (const FrameSnapshot& f : views) game.drawWalls(f);
+		});
+	}
+	game.groupWallsByTexture = true;
+
+	useLevelMap(game.level);
 }
 
-void Game::setPos(vec2 p) {
-	pos = p;
+// Views along the courtyard's camera path, with its walls of many heights and
+// with every wall made defaultWallHeight, which never needs more than one hit
+// per column. From eye height the low walls are seen over; from above, all of
+// them are.
+void benchWallHeights(Window& window) {
+	Game& game = window.game;
+	Level courtyard = loadLevel("levels/courtyard.txt");
+
+	vector<FrameSnapshot> views(16);
+	for (int i = 0; i < (int)views.size(); i++) {
+		FrameSnapshot& f = views[i];
+		game.writeSnapshot(f);
+		CameraKey k = sampleCameraPath(courtyard.path, courtyard.path.back().time * i / views.size());
+		f.pos = { k.pos.x * textureSize, k.pos.y * textureSize };
+		f.angle = degToRad(k.angle);
+		f.dir = { cosf(f.angle), sinf(f.angle) };
+	}
+
+	for (int flat = 0; flat < 2; flat++) {
+		if (flat) courtyard.heights.assign(courtyard.tiles.size(), defaultWallHeight);
+		useLevelMap(courtyard);
+		for (float camZ : { HEIGHT, 40.0f }) {
+			int columns = 0;
+			int extra = 0;
+			string name = string("drawWalls courtyard ") + (flat ? "flat" : "heights") + " eye " + to_string((int)camZ);
+			microbench(name, "column", (double)views[0].width * views.size(), [&] {
+				for (FrameSnapshot& f : views) {
+					f.camZ = camZ;
+					game.drawWalls(f);
+					columns += f.width;
+					extra += game.extraWallHits;
+				}
+			});
+			printf("%-40s %9.2f more wall faces per column\n", "", (float)extra / columns);
+		}
+	}
+
+	useLevelMap(game.level);
 }
 
-void Game::setAngle(float a) {
-	angle = a;
-	dir = { cosf(a), sinf(a) };
+// Views along the halls' camera path, drawing its floors and ceilings as
+// visplanes, and again with every floor and ceiling at zero, which goes back to
+// single-hit walls and whole-row floors.
+void benchSectors(Window& window) {
+	Game& game = window.game;
+	Level halls = loadLevel("levels/halls.txt");
+
+	vector<FrameSnapshot> views(16);
+	for (int i = 0; i < (int)views.size(); i++) {
+		FrameSnapshot& f = views[i];
+		game.writeSnapshot(f);
+		CameraKey k = sampleCameraPath(halls.path, halls.path.back().time * i / views.size());
+		f.pos = { k.pos.x * textureSize, k.pos.y * textureSize };
+		f.angle = degToRad(k.angle);
+		f.dir = { cosf(f.angle), sinf(f.angle) };
+		f.camZ = k.z;
+	}
+
+	for (int flat = 0; flat < 2; flat++) {
+		if (flat) {
+			halls.floors.assign(halls.tiles.size(), 0);
+			halls.ceilings.assign(halls.tiles.size(), 0);
+		}
+		useLevelMap(halls);
+		int frames = 0;
+		int planes = 0;
+		string name = string("drawWalls+drawFloor halls ") + (flat ? "flat" : "sectors");
+		microbench(name, "frame", (double)views.size(), [&] {
+			for (FrameSnapshot& f : views) {
+				game.drawWalls(f);
+				game.drawFloor(f);
+				frames++;
+				planes += game.numVisplanes;
+			}
+		});
+		if (!flat) printf("%-40s %9.2f visplanes per frame\n", "", (float)planes / frames);
+	}
+
+	useLevelMap(game.level);
 }
 
-Window::Window() : game(this) {}
+// The same views with every texture scaled (nearest neighbour) to each size
+// the atlas supports.
+void benchTextureSizes(Window& window) {
+	Game& game = window.game;
+	TextureAtlas<RGB> loaded = game.textures;
+
+	FrameSnapshot f;
+	game.writeSnapshot(f);
+	double floorPixels = (double)f.width * (f.height - f.height / 2);
+
+	for (int log = minTextureSizeLog; log <= maxTextureSizeLog; log++) {
+		int size = 1 << log;
+		TextureAtlas<RGB> scaled;
+		vector<RGB> pixels(size * size);
+		for (int t = 0; t < loaded.count(); t++) {
+			const RGB* src = loaded.data(t);
+			int srcSize = loaded.size(t);
+			for (int y = 0; y < size; y++) {
+				for (int x = 0; x < size; x++) {
+					pixels[y * size + x] = src[(y * srcSize / size) * srcSize + x * srcSize / size];
+				}
+			}
+			scaled.add(pixels.data(), size, size);
+		}
+		game.textures = scaled;
+
+		string suffix = " " + to_string(size) + "px textures";
+		microbench("drawFloor" + suffix, "pixel", floorPixels, [&] {
+			game.drawFloor(f);
+		});
+		microbench("drawWalls" + suffix, "column", f.width, [&] {
+			f.angle += turnSpeed * dt;
+			f.dir = { cosf(f.angle), sinf(f.angle) };
+			game.drawWalls(f);
+		});
+	}
 
-Window::~Window() {
-	if (screenTexture) SDL_DestroyTexture(screenTexture);
-	if (renderer) SDL_DestroyRenderer(renderer);
-	if (window) SDL_DestroyWindow(window);
+	game.textures = loaded;
+}
 
-	SDL_Quit();
+void benchSprites(Window& window) {
+	Game& game = window.game;
+	const int counts[] = { 1, 16, 128, 1024 };
+
+	FrameSnapshot f;
+	game.writeSnapshot(f);
+	game.drawWalls(f);
+
+	for (int overlap = 0; overlap < 2; overlap++) {
+		for (int count : counts) {
+			// Spread out over the open room, or all stacked in a small area in
+			// front of the camera so they overdraw each other. They go straight
+			// into the snapshot, so none are culled.
+			uint32_t seed = 7;
+			f.sprites.clear();
+			for (int i = 0; i < count; i++) {
+				Sprite s;
+				if (overlap) {
+					s.pos = { game.pos.x + 100 + randomFloat(seed) * 40, game.pos.y - 20 + randomFloat(seed) * 40 };
+				}
+				else {
+					s.pos = { (1 + randomFloat(seed) * (mapSize - 2)) * textureSize, (4 + randomFloat(seed) * 5) * textureSize };
+				}
+				f.sprites.push_back(s);
+			}
+
+			string name = "drawSprites " + to_string(count) + (overlap ? " overlapping" : " spread");
+			microbench(name, "sprite", count, [&] {
+				game.drawSprites(f);
+			});
+		}
+	}
 }
 
-void Window::init() {
-	sdl_e(SDL_Init(SDL_INIT_EVERYTHING));
+// Single-threaded, over the whole image.
+void benchUpscale() {
+	struct Case {
+		int srcW, srcH, dstW, dstH;
+		bool nearest;
+	};
+	const Case cases[] = {
+		{ 320, 180, 640, 360, true },
+		{ 320, 180, 960, 540, true },
+		{ 320, 180, 1280, 720, true },
+		{ 320, 180, 640, 360, false },
+		{ 448, 252, 640, 360, false },
+		{ 640, 360, 1920, 1080, false },
+	};
 
-	int scale = 1;
-	window = sdl_e(SDL_CreateWindow("Raycast Game", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width * scale, height * scale, SDL_WINDOW_RESIZABLE));
-	renderer = sdl_e(SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC));
+	for (const Case& c : cases) {
+		uint32_t seed = 5;
+		vector<uint8_t> src(c.srcW * c.srcH * 3);
+		for (uint8_t& b : src) b = (uint8_t)xorshift(seed);
+		vector<uint8_t> dst(c.dstW * c.dstH * 3);
+
+		string name = string(c.nearest ? "upscale nearest " : "upscale bilinear ") + to_string(c.srcW) + "x" + to_string(c.srcH) + " to " + to_string(c.dstW) + "x" + to_string(c.dstH);
+		microbench(name, "pixel", (double)c.dstW * c.dstH, [&] {
+			if (c.nearest) upscale::nearest(src.data(), c.srcW, c.srcH, dst.data(), c.dstW / c.srcW, 0, c.dstH);
+			else upscale::bilinear(src.data(), c.srcW, c.srcH, dst.data(), c.dstW, c.dstH, 0, c.dstH);
+		});
+	}
+}
 
-	sdl_e(SDL_RenderSetLogicalSize(renderer, width, height));
-	//sdl_e(SDL_RenderSetIntegerScale(renderer, SDL_TRUE));
-	SDL_SetWindowMinimumSize(window, width, height);
+// Isolated timings of the render kernels, for tuning them one at a time.
+void runMicrobenchmarks() {
+	benchRaycast();
+
+	Window window;
+	window.initHeadless();
+	window.game.setPos({ 1.5f * textureSize, 5.5f * textureSize });
+	window.game.setAngle(0);
+	// Sets up the pixel and depth buffers the kernels below draw into.
+	window.drawFrame();
+
+	benchFloor(window);
+	benchWalls(window);
+	benchWallTextures(window);
+	benchTextureSizes(window);
+	benchWallHeights(window);
+	benchSectors(window);
+	benchSprites(window);
+	benchUpscale();
+}
+
+struct GoldenPose {
+	const char* name;
+	const char* level;
+	CameraKey camera;
+};
 
-	screenTexture = sdl_e(SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING, width, height));
-	pixelBuf = make_unique<RGB[]>(width * height);
-	pixelPtr = pixelBuf.get();
+// Fixed views covering close and far walls, sprites, a jump, wide and narrow
+// fields of view, walls of different heights and raised and sunken floors
+// under ceilings. Camera positions are in tiles, angles in degrees.
+const GoldenPose goldenPoses[] = {
+	{ "start", "default", { 0, { 1.5f, 4.5f }, 0, 70, 16 } },
+	{ "barrels", "default", { 0, { 7.5f, 5.5f }, 180, 70, 16 } },
+	{ "corner", "default", { 0, { 1.2f, 8.8f }, 315, 70, 16 } },
+	{ "jump", "default", { 0, { 5.5f, 7.5f }, 200, 70, 48 } },
+	{ "wide", "default", { 0, { 1.5f, 7.5f }, 270, 110, 16 } },
+	{ "narrow", "default", { 0, { 8.5f, 8.5f }, 225, 40, 16 } },
+	{ "arena", "levels/arena.txt", { 0, { 27, 20 }, 120, 80, 16 } },
+	{ "courtyard", "levels/courtyard.txt", { 0, { 12, 5.5f }, 100, 80, 40 } },
+	{ "pit", "levels/halls.txt", { 0, { 5.5f, 11.5f }, 300, 70, 32 } },
+	{ "hall", "levels/halls.txt", { 0, { 12.5f, 16.5f }, 200, 70, 32 } },
+};
 
-	depthBuf = make_unique<float[]>(width);
+const char* const goldenDir = "golden";
 
-	game.init();
+void writePPM(const string& path, const RGB* pixels, int w, int h) {
+	ofstream file(path, ios::binary);
+	if (!file) throw runtime_error("Cannot write " + path);
+	file << "P6\n" << w << " " << h << "\n255\n";
+	file.write((const char*)pixels, (size_t)w * h * sizeof(RGB));
 }
 
-bool firstPerson = true;
-void Window::run() {
-	float period = 1.0f / SDL_GetPerformanceFrequency();
-	uint64_t t0 = SDL_GetPerformanceCounter();
+bool readPPM(const string& path, vector<RGB>& pixels, int& w, int& h) {
+	ifstream file(path, ios::binary);
+	string magic;
+	int maxValue;
+	if (!(file >> magic >> w >> h >> maxValue) || magic != "P6" || maxValue != 255) return false;
+	file.get();
+	pixels.resize((size_t)w * h);
+	return (bool)file.read((char*)pixels.data(), pixels.size() * sizeof(RGB));
+}
 
-	while (gameRunning) {
-		lastTime = time;
-		uint64_t now = SDL_GetPerformanceCounter();
-		time = (now - t0) * period;
+void makeDirectory(const char* path) {
+#ifdef _WIN32
+	_mkdir(path);
+#else
+	mkdir(path, 0755);
+#endif
+}
 
-		timeAccumulator += time - lastTime;
+// Renders every golden pose headless and compares it with the reference image
+// in golden/. A pixel differs when any channel is off by more than tolerance;
+// a pose fails when more than maxBadFraction of its pixels differ. Failing
+// poses get a diff image: differing pixels in red, the rest dimmed. With
+// update set, the references are rewritten instead. Returns whether all
+// poses passed.
+bool runGoldenTests(bool update, int tolerance, float maxBadFraction) {
+	if (update) makeDirectory(goldenDir);
+
+	bool allPassed = true;
+	for (const GoldenPose& pose : goldenPoses) {
+		Window window;
+		window.game.level = strcmp(pose.level, "default") == 0 ? defaultLevel() : loadLevel(pose.level);
+		window.initHeadless();
+
+		Game& game = window.game;
+		int width = game.renderWidth;
+		int height = game.renderHeight;
+		game.setPos({ pose.camera.pos.x * textureSize, pose.camera.pos.y * textureSize });
+		game.setAngle(degToRad(pose.camera.angle));
+		game.setFovX(degToRad(pose.camera.fov));
+		game.camZ = pose.camera.z;
+		window.drawFrame();
+
+		string refPath = string(goldenDir) + "/" + pose.name + ".ppm";
+		if (update) {
+			writePPM(refPath, window.pixelPtr, width, height);
+			printf("%-10s updated\n", pose.name);
+			continue;
+		}
 
-		mouseRelX = 0;
-
-		SDL_Event e;
-		while (SDL_PollEvent(&e)) {
-			switch (e.type) {
-			case SDL_QUIT:
-				gameRunning = false;
-				break;
-			case SDL_MOUSEMOTION:
-				mouseRelX = e.motion.xrel;
-				break;
-			}
+		vector<RGB> ref;
+		int w, h;
+		if (!readPPM(refPath, ref, w, h) || w != width || h != height) {
+			printf("%-10s FAIL: no %dx%d reference at %s (run --golden-update)\n", pose.name, width, height, refPath.c_str());
+			allPassed = false;
+			continue;
 		}
 
-		lastKeystate = keyState;
+		int bad = 0;
+		int maxDiff = 0;
+		vector<RGB> diff(ref.size());
+		for (size_t i = 0; i < ref.size(); i++) {
+			RGB a = window.pixelPtr[i];
+			RGB b = ref[i];
+			int d = max(max(abs(a.r - b.r), abs(a.g - b.g)), abs(a.b - b.b));
+			maxDiff = max(maxDiff, d);
+			if (d > tolerance) {
+				bad++;
+				diff[i] = { 255, 0, 0 };
+			}
+			else {
+				uint8_t grey = (uint8_t)((a.r + a.g + a.b) / 12);
+				diff[i] = { grey, grey, grey };
+			}
+		}
 
-		int numKeys;
-		const uint8_t* keyStatePtr = SDL_GetKeyboardState(&numKeys);
-		keyState.resize(numKeys);
-		copy(keyStatePtr, keyStatePtr + numKeys, keyState.begin());
+		float badFraction = (float)bad / ref.size();
+		bool passed = badFraction <= maxBadFraction;
+		printf("%-10s %s: %d pixels differ (%.4f%%), max channel difference %d\n", pose.name, passed ? "ok" : "FAIL", bad, badFraction * 100, maxDiff);
 
-		while (timeAccumulator > dt) {
-			timeAccumulator -= dt;
-			game.update();
+		if (!passed) {
+			string diffPath = string(goldenDir) + "/" + pose.name + ".diff.ppm";
+			writePPM(diffPath, diff.data(), width, height);
+			printf("           diff written to %s\n", diffPath.c_str());
+			allPassed = false;
 		}
-		//cout << "FRAME\n";
+	}
+	return allPassed;
+}
 
-		SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-		SDL_RenderClear(renderer);
+int runMode(int argc, char** argv) {
+	if (argc > 1 && strcmp(argv[1], "--bench-collision") == 0) {
+		int numMovers = argc > 2 ? atoi(argv[2]) : 10000;
+		int ticks = argc > 3 ? atoi(argv[3]) : 600;
+		const char* levelPath = argc > 4 ? argv[4] : "default";
+		Level level = strcmp(levelPath, "default") == 0 ? defaultLevel() : loadLevel(levelPath);
+		benchCollision(level, numMovers, ticks);
+		return 0;
+	}
 
-		memset(pixelPtr, 0, pixelBufSize);
-		game.draw();
-		sdl_e(SDL_UpdateTexture(screenTexture, nullptr, pixelPtr, pixelPitch));
-		if (keyPressed(SDL_SCANCODE_T)) {
-			firstPerson = !firstPerson;
-		}
-		if (firstPerson) SDL_RenderCopy(renderer, screenTexture, nullptr, nullptr);
+	if (argc > 1 && strcmp(argv[1], "--bench-entities") == 0) {
+		int count = argc > 2 ? atoi(argv[2]) : 4096;
+		int ticks = argc > 3 ? atoi(argv[3]) : 300;
+		const char* levelPath = argc > 4 ? argv[4] : "levels/arena.txt";
+		Level level = strcmp(levelPath, "default") == 0 ? defaultLevel() : loadLevel(levelPath);
+		benchEntities(level, count, ticks);
+		return 0;
+	}
 
-		if (keyPressed(SDL_SCANCODE_ESCAPE)) {
-			SDL_SetRelativeMouseMode((SDL_bool)!SDL_GetRelativeMouseMode());
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+		vector<string> levels;
+		const char* outPath = nullptr;
+		bool checkerboard = false;
+		for (int i = 2; i < argc; i++) {
+			if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) outPath = argv[++i];
+			else if (strcmp(argv[i], "--checkerboard") == 0) checkerboard = true;
+			else levels.push_back(argv[i]);
+		}
+		if (levels.empty()) {
+			levels = { "default", "levels/maze.txt", "levels/arena.txt", "levels/courtyard.txt", "levels/halls.txt" };
 		}
 
-		uint64_t frameEnd = SDL_GetPerformanceCounter();
-		float frameTime = (frameEnd - now) * period;
-		//cout << frameTime * 1000 << "\n";
+		if (outPath) {
+			ofstream out(outPath);
+			if (!out) throw runtime_error(string("Cannot write ") + outPath);
+			benchCameraPath(levels, checkerboard, out);
+		}
+		else {
+			benchCameraPath(levels, checkerboard, cout);
+		}
+		return 0;
+	}
 
-		SDL_RenderPresent(renderer);
+	if (argc > 1 && (strcmp(argv[1], "--golden") == 0 || strcmp(argv[1], "--golden-update") == 0)) {
+		bool update = strcmp(argv[1], "--golden-update") == 0;
+		int tolerance = 0;
+		float maxBadFraction = 0;
+		for (int i = 2; i + 1 < argc; i += 2) {
+			if (strcmp(argv[i], "--tolerance") == 0) tolerance = atoi(argv[i + 1]);
+			else if (strcmp(argv[i], "--max-bad") == 0) maxBadFraction = (float)atof(argv[i + 1]);
+		}
+		return runGoldenTests(update, tolerance, maxBadFraction) ? 0 : 1;
 	}
-}
 
-bool Window::keyDown(int key) {
-	return keyState[key];
-}
+	if (argc > 1 && strcmp(argv[1], "--microbench") == 0) {
+		runMicrobenchmarks();
+		return 0;
+	}
 
-bool Window::keyPressed(int key) {
-	return keyState[key] && !lastKeystate[key];
-}
+	if (argc > 2 && strcmp(argv[1], "--replay") == 0) {
+		ReplayOptions options;
+		for (int i = 3; i < argc; i++) {
+			if (strcmp(argv[i], "--no-draw") == 0) options.draw = false;
+			else if (strcmp(argv[i], "--reproject") == 0) options.reproject = true;
+			else if (strcmp(argv[i], "--checkerboard") == 0) options.checkerboard = true;
+			else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) options.csvPath = argv[++i];
+			else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) options.capturePath = argv[++i];
+		}
+		replayInput(argv[2], options);
+		return 0;
+	}
 
-int main() {
 	Window game;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			game.recorder = make_unique<InputRecorder>(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+			game.capture = make_unique<VideoCapture>(argv[++i], windowWidth, windowHeight, FPS);
+		}
+		else if (strcmp(argv[i], "--resolution") == 0 && i + 1 < argc) {
+			int w, h;
+			if (sscanf(argv[++i], "%dx%d", &w, &h) != 2 || w < 1 || h < 1) {
+				throw runtime_error(string("Bad resolution ") + argv[i] + ", expected WxH");
+			}
+			game.setResolution(w, h);
+		}
+		else if (strcmp(argv[i], "--reproject") == 0) {
+			game.game.reproject = true;
+		}
+		else if (strcmp(argv[i], "--checkerboard") == 0) {
+			game.game.checkerboard = true;
+		}
+		else if (strcmp(argv[i], "--dynamic-resolution") == 0) {
+			game.dynamicResolution = true;
+			if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) {
+				game.targetFrameTime = (float)atof(argv[++i]) / 1000;
+			}
+		}
+	}
 	game.init();
 	game.run();
 
 	return 0;
 }
+
+// --trace <file> and --perf can be given with any mode and are stripped before
+// the mode sees its arguments.
+int main(int argc, char** argv) {
+	vector<char*> args;
+	const char* tracePath = nullptr;
+	bool perf = false;
+	for (int i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) tracePath = argv[++i];
+		else if (strcmp(argv[i], "--perf") == 0) perf = true;
+		else args.push_back(argv[i]);
+	}
+
+	bool perfMode = args.size() > 1 && (strcmp(args[1], "--bench") == 0 || strcmp(args[1], "--microbench") == 0);
+	if (perf && !perfMode) {
+		cerr << "--perf only applies to --bench and --microbench, ignoring it\n";
+		perf = false;
+	}
+
+	unique_ptr<PerfCounters> counters;
+	if (perf) {
+		counters = make_unique<PerfCounters>();
+		if (counters->available()) perfCounters = counters.get();
+		else cerr << "Hardware counters unavailable: " << counters->lastError() << "\n";
+	}
+
+	trace::setThreadName("main");
+	if (tracePath) trace::start();
+
+	int result = runMode((int)args.size(), args.data());
+
+	if (tracePath) {
+		trace::stop();
+		if (!trace::write(tracePath)) throw runtime_error(string("Cannot write ") + tracePath);
+	}
+	perfCounters = nullptr;
+	return result;
+}
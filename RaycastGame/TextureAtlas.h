@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Square power-of-two textures from 32 to 512 texels, packed one after another
+// into a single array, and samplers specialised on the texture size and on
+// how texels are read.
+//
+// Kernels look up a texture's size at run time once, then go through
+// withTextureSize to an instantiation for that size, so the shifts and masks
+// inside the texel loop are constants just as they were with one fixed size.
+
+const int minTextureSizeLog = 5;
+const int maxTextureSizeLog = 9;
+
+template <class Pixel>
+class TextureAtlas {
+public:
+	// Copies in a width x height texture and returns its index.
+	int add(const Pixel* pixels, int width, int height) {
+		int log = minTextureSizeLog;
+		while (log < maxTextureSizeLog && (1 << log) < width) log++;
+		if (width != height || width != 1 << log) {
+			throw std::runtime_error("Textures must be square with a power of two size from 32 to 512, not " + std::to_string(width) + "x" + std::to_string(height));
+		}
+
+		entries.push_back({ texels.size(), log });
+		texels.insert(texels.end(), pixels, pixels + width * height);
+		return (int)entries.size() - 1;
+	}
+
+	int count() const {
+		return (int)entries.size();
+	}
+
+	int sizeLog(int texture) const {
+		return entries[texture].sizeLog;
+	}
+
+	int size(int texture) const {
+		return 1 << entries[texture].sizeLog;
+	}
+
+	// Rows of size(texture) texels, top to bottom.
+	const Pixel* data(int texture) const {
+		return texels.data() + entries[texture].offset;
+	}
+
+private:
+	struct Entry {
+		size_t offset;
+		int sizeLog;
+	};
+	std::vector<Entry> entries;
+	std::vector<Pixel> texels;
+};
+
+// Pixel formats. Every texel of an opaque texture is drawn; colour keyed
+// textures leave out the magenta ones.
+struct OpaqueTexels {
+	template <class Pixel>
+	static bool visible(const Pixel&) {
+		return true;
+	}
+};
+
+struct ColourKeyedTexels {
+	template <class Pixel>
+	static bool visible(const Pixel& p) {
+		return !(p.r == 255 && p.g == 0 && p.b == 255);
+	}
+};
+
+// Reads a texture of 1 << SizeLog texels square, wrapping coordinates.
+template <class Pixel, int SizeLog, class Format = OpaqueTexels>
+struct TextureSampler {
+	static const int sizeLog = SizeLog;
+	static const int size = 1 << SizeLog;
+	static const int mask = size - 1;
+
+	TextureSampler(const TextureAtlas<Pixel>& atlas, int texture) : texels(atlas.data(texture)) {}
+
+	Pixel fetch(int u, int v) const {
+		return texels[((v & mask) << SizeLog) + (u & mask)];
+	}
+
+	static bool visible(const Pixel& p) {
+		return Format::visible(p);
+	}
+
+	const Pixel* texels;
+};
+
+// Calls f with std::integral_constant<int, sizeLog>, for use with a generic
+// lambda that instantiates its kernel for each texture size.
+template <class F>
+void withTextureSize(int sizeLog, F&& f) {
+	switch (sizeLog) {
+	case 5: f(std::integral_constant<int, 5>()); break;
+	case 6: f(std::integral_constant<int, 6>()); break;
+	case 7: f(std::integral_constant<int, 7>()); break;
+	case 8: f(std::integral_constant<int, 8>()); break;
+	case 9: f(std::integral_constant<int, 9>()); break;
+	default: throw std::logic_error("Unsupported texture size");
+	}
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Scoped timeline markers written out in the Chrome trace event format, for
+// viewing in Perfetto or chrome://tracing.
+//
+//   TRACE_SCOPE("drawWalls");
+//
+// records a complete event from that line to the end of the enclosing scope,
+// on the calling thread's track. Names must be string literals (or otherwise
+// outlive the trace). While tracing is off a marker costs one relaxed atomic
+// load; defining DISABLE_TRACING removes them entirely.
+//
+// Each thread appends to its own buffer, so recording takes no locks.
+
+namespace trace {
+
+struct Event {
+	const char* name;
+	int64_t start;
+	int64_t duration;
+};
+
+struct ThreadBuffer {
+	int id;
+	std::string name;
+	std::vector<Event> events;
+};
+
+// Per-thread cap so a forgotten trace cannot eat all memory.
+const size_t maxEventsPerThread = 1 << 20;
+
+struct State {
+	std::atomic<bool> enabled{ false };
+	std::mutex mutex;
+	std::vector<std::shared_ptr<ThreadBuffer>> threads;
+	std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+};
+
+inline State& state() {
+	static State s;
+	return s;
+}
+
+inline bool enabled() {
+	return state().enabled.load(std::memory_order_relaxed);
+}
+
+// Microseconds since the trace origin.
+inline int64_t now() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - state().origin).count();
+}
+
+inline ThreadBuffer& threadBuffer() {
+	static thread_local std::shared_ptr<ThreadBuffer> buffer;
+	if (!buffer) {
+		State& s = state();
+		std::lock_guard<std::mutex> lock(s.mutex);
+		buffer = std::make_shared<ThreadBuffer>();
+		buffer->id = (int)s.threads.size() + 1;
+		buffer->name = "thread " + std::to_string(buffer->id);
+		s.threads.push_back(buffer);
+	}
+	return *buffer;
+}
+
+inline void setThreadName(const std::string& name) {
+	ThreadBuffer& b = threadBuffer();
+	std::lock_guard<std::mutex> lock(state().mutex);
+	b.name = name;
+}
+
+inline void start() {
+	State& s = state();
+	{
+		std::lock_guard<std::mutex> lock(s.mutex);
+		for (auto& t : s.threads) t->events.clear();
+		s.origin = std::chrono::steady_clock::now();
+	}
+	s.enabled = true;
+}
+
+inline void stop() {
+	state().enabled = false;
+}
+
+// Writes everything recorded so far. Call after stop(), once other threads
+// have stopped recording.
+inline bool write(const char* path) {
+	std::ofstream out(path);
+	if (!out) return false;
+
+	State& s = state();
+	std::lock_guard<std::mutex> lock(s.mutex);
+
+	out << "{\"traceEvents\":[\n";
+	bool first = true;
+	for (auto& t : s.threads) {
+		out << (first ? "" : ",\n");
+		first = false;
+		out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t->id
+			<< ",\"args\":{\"name\":\"" << t->name << "\"}}";
+		for (const Event& e : t->events) {
+			out << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << t->id
+				<< ",\"ts\":" << e.start << ",\"dur\":" << e.duration << "}";
+		}
+	}
+	out << "\n]}\n";
+	return (bool)out;
+}
+
+class Scope {
+public:
+	explicit Scope(const char* name) : name(name) {
+		if (enabled()) start = now();
+	}
+
+	~Scope() {
+		if (start < 0 || !enabled()) return;
+		ThreadBuffer& b = threadBuffer();
+		if (b.events.size() < maxEventsPerThread) {
+			b.events.push_back({ name, start, now() - start });
+		}
+	}
+
+	Scope(const Scope&) = delete;
+	Scope& operator=(const Scope&) = delete;
+
+private:
+	const char* name;
+	int64_t start = -1;
+};
+
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#ifdef DISABLE_TRACING
+#define TRACE_SCOPE(name)
+#else
+#define TRACE_SCOPE(name) trace::Scope TRACE_CONCAT(traceScope, __LINE__)(name)
+#endif
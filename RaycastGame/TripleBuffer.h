@@ -0,0 +1,89 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <utility>
+
+// Hands values from one producer thread to one consumer thread without either
+// waiting for the other to finish with a value.
+//
+// The producer fills back() and calls publish(); the consumer calls update()
+// (or waitUpdate()) and reads front(). A third slot sits between them holding
+// the newest published value, so the producer can always start on the next
+// one and the consumer always sees the latest. Values the consumer never got
+// to are simply overwritten.
+//
+// Slots are reused, so a producer that fills back() in place keeps any
+// allocations made for earlier values.
+
+template <class T>
+class TripleBuffer {
+public:
+	TripleBuffer() = default;
+
+	explicit TripleBuffer(const T& initial) {
+		for (T& slot : slots) slot = initial;
+	}
+
+	TripleBuffer(const TripleBuffer&) = delete;
+	TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+	// Producer side.
+	T& back() {
+		return slots[backIndex];
+	}
+
+	void publish() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			std::swap(backIndex, middleIndex);
+			fresh = true;
+		}
+		cv.notify_one();
+	}
+
+	// Wakes a consumer blocked in waitUpdate() for good.
+	void close() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closed = true;
+		}
+		cv.notify_all();
+	}
+
+	// Consumer side. Takes the newest published value if there is one the
+	// consumer has not seen yet, and returns whether front() changed.
+	bool update() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!fresh) return false;
+		std::swap(frontIndex, middleIndex);
+		fresh = false;
+		return true;
+	}
+
+	// Like update(), but blocks until there is a new value. Returns false
+	// once the buffer has been closed.
+	bool waitUpdate() {
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this] { return fresh || closed; });
+		if (closed) return false;
+		std::swap(frontIndex, middleIndex);
+		fresh = false;
+		return true;
+	}
+
+	const T& front() const {
+		return slots[frontIndex];
+	}
+
+private:
+	T slots[3];
+	int backIndex = 0;
+	int middleIndex = 1;
+	int frontIndex = 2;
+	bool fresh = false;
+	bool closed = false;
+
+	std::mutex mutex;
+	std::condition_variable cv;
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UPSCALE_SSE2
+#endif
+
+#include "CpuFeatures.h"
+
+// Scalers from a low internal resolution to the output size, for packed 24-bit
+// RGB images with no padding between rows.
+//
+// Each call fills destination rows [y0, y1) and reads only the source, so an
+// image can be split into bands that are scaled on different threads.
+//
+// Integer nearest-neighbour uses SSSE3 (pshufb) when the CPU has it, checked
+// at run time; the bilinear row blend uses SSE2 where the build targets it.
+// Without them the same results come from the scalar loops.
+
+namespace upscale {
+
+#ifdef CPU_X86
+// Shuffles that turn five source pixels (15 bytes of one 16-byte load) into
+// 15 * k output bytes, as up to four 16-byte stores. The last store is moved
+// back to end exactly on the output and overlaps the one before it.
+struct NearestMasks {
+	__m128i mask[4];
+	int offset[4];
+	int count;
+};
+
+inline NearestMasks makeNearestMasks(int k) {
+	NearestMasks m;
+	int total = 15 * k;
+	m.count = (total + 15) / 16;
+	for (int i = 0; i < m.count; i++) {
+		m.offset[i] = i * 16 < total - 16 ? i * 16 : total - 16;
+		uint8_t bytes[16];
+		for (int b = 0; b < 16; b++) {
+			int j = m.offset[i] + b;
+			bytes[b] = (uint8_t)(j / 3 / k * 3 + j % 3);
+		}
+		m.mask[i] = _mm_loadu_si128((const __m128i*)bytes);
+	}
+	return m;
+}
+
+inline const NearestMasks& nearestMasks(int k) {
+	static const NearestMasks masks[3] = { makeNearestMasks(2), makeNearestMasks(3), makeNearestMasks(4) };
+	return masks[k - 2];
+}
+
+// Repeats each of the leading pixels of a row k times (2 <= k <= 4), five at
+// a time, and returns how many it did.
+CPU_TARGET_SSSE3 inline int nearestRowSsse3(const uint8_t* src, int srcW, int k, uint8_t* dst) {
+	const NearestMasks& m = nearestMasks(k);
+	int x = 0;
+	// Stop while a whole 16-byte load still fits in the row.
+	for (; x + 6 <= srcW; x += 5) {
+		__m128i in = _mm_loadu_si128((const __m128i*)(src + x * 3));
+		uint8_t* out = dst + x * k * 3;
+		for (int i = 0; i < m.count; i++) {
+			_mm_storeu_si128((__m128i*)(out + m.offset[i]), _mm_shuffle_epi8(in, m.mask[i]));
+		}
+	}
+	return x;
+}
+#endif
+
+// Repeats each pixel of one row k times.
+inline void nearestRow(const uint8_t* src, int srcW, int k, uint8_t* dst) {
+	int x = 0;
+#ifdef CPU_X86
+	if (k >= 2 && k <= 4 && cpuHasSsse3()) x = nearestRowSsse3(src, srcW, k, dst);
+#endif
+	for (; x < srcW; x++) {
+		for (int j = 0; j < k; j++) memcpy(dst + (x * k + j) * 3, src + x * 3, 3);
+	}
+}
+
+// Nearest-neighbour scale by a whole factor k: the output is srcW * k by
+// srcH * k.
+inline void nearest(const uint8_t* src, int srcW, int srcH, uint8_t* dst, int k, int y0, int y1) {
+	size_t pitch = (size_t)srcW * k * 3;
+	for (int y = y0; y < y1 && y < srcH * k; y++) {
+		uint8_t* out = dst + y * pitch;
+		// Rows repeat k times; copy the previous one when it belongs to the
+		// same group and this band has already written it.
+		if (y > y0 && (y - 1) / k == y / k) {
+			memcpy(out, out - pitch, pitch);
+		}
+		else {
+			nearestRow(src + (size_t)(y / k) * srcW * 3, srcW, k, out);
+		}
+	}
+}
+
+// Sample positions along one axis: for each output coordinate, the first
+// source texel and the weight of the next one, with 8 fractional bits. Texel
+// centres line up with the output's, as in GPU bilinear filtering.
+inline void bilinearAxis(int srcN, int dstN, std::vector<int>& index, std::vector<int>& weight) {
+	index.resize(dstN);
+	weight.resize(dstN);
+	for (int i = 0; i < dstN; i++) {
+		int64_t p = (int64_t)(2 * i + 1) * srcN * 256 / (2 * dstN) - 128;
+		if (p < 0) p = 0;
+		int i0 = (int)(p >> 8);
+		int w = (int)(p & 255);
+		if (i0 >= srcN - 1) {
+			i0 = srcN - 1;
+			w = 0;
+		}
+		index[i] = i0;
+		weight[i] = w;
+	}
+}
+
+// out = a + (b - a) * w / 256, byte by byte.
+inline void blendRows(const uint8_t* a, const uint8_t* b, int w, uint8_t* out, int n) {
+	int i = 0;
+#ifdef UPSCALE_SSE2
+	__m128i zero = _mm_setzero_si128();
+	__m128i wa = _mm_set1_epi16((short)(256 - w));
+	__m128i wb = _mm_set1_epi16((short)w);
+	for (; i + 16 <= n; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+		// Both products fit in 16 bits unsigned: 255 * 256 at most in total.
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa), _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa), _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+		lo = _mm_srli_epi16(lo, 8);
+		hi = _mm_srli_epi16(hi, 8);
+		_mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; i < n; i++) out[i] = (uint8_t)((a[i] * (256 - w) + b[i] * w) >> 8);
+}
+
+// Bilinear scale to any size. Source rows are first scaled horizontally
+// (once each per band), then pairs of them are blended for every output row,
+// which is where most of the work is.
+inline void bilinear(const uint8_t* src, int srcW, int srcH, uint8_t* dst, int dstW, int dstH, int y0, int y1) {
+	static thread_local std::vector<int> xIndex, xWeight, yIndex, yWeight;
+	static thread_local std::vector<uint8_t> rows[2];
+	bilinearAxis(srcW, dstW, xIndex, xWeight);
+	bilinearAxis(srcH, dstH, yIndex, yWeight);
+
+	int rowBytes = dstW * 3;
+	int cached[2] = { -1, -1 };
+	for (int r = 0; r < 2; r++) rows[r].resize(rowBytes);
+
+	// Byte offsets of both source texels for each output column.
+	static thread_local std::vector<int> xOffset0, xOffset1;
+	xOffset0.resize(dstW);
+	xOffset1.resize(dstW);
+	for (int x = 0; x < dstW; x++) {
+		xOffset0[x] = xIndex[x] * 3;
+		xOffset1[x] = (xIndex[x] + 1 < srcW ? xIndex[x] + 1 : xIndex[x]) * 3;
+	}
+
+	auto scaleRow = [&](int sy, std::vector<uint8_t>& row) {
+		const uint8_t* in = src + (size_t)sy * srcW * 3;
+		uint8_t* out = row.data();
+		for (int x = 0; x < dstW; x++) {
+			const uint8_t* p0 = in + xOffset0[x];
+			const uint8_t* p1 = in + xOffset1[x];
+			int w = xWeight[x];
+			out[0] = (uint8_t)((p0[0] * (256 - w) + p1[0] * w) >> 8);
+			out[1] = (uint8_t)((p0[1] * (256 - w) + p1[1] * w) >> 8);
+			out[2] = (uint8_t)((p0[2] * (256 - w) + p1[2] * w) >> 8);
+			out += 3;
+		}
+	};
+
+	for (int y = y0; y < y1 && y < dstH; y++) {
+		int sy0 = yIndex[y];
+		int sy1 = sy0 + 1 < srcH ? sy0 + 1 : sy0;
+
+		// Moving down, the old lower row becomes the new upper one.
+		if (cached[0] != sy0) {
+			if (cached[1] == sy0) {
+				std::swap(rows[0], rows[1]);
+				std::swap(cached[0], cached[1]);
+			}
+			else {
+				scaleRow(sy0, rows[0]);
+				cached[0] = sy0;
+			}
+		}
+		if (cached[1] != sy1) {
+			scaleRow(sy1, rows[1]);
+			cached[1] = sy1;
+		}
+
+		blendRows(rows[0].data(), rows[1].data(), yWeight[y], dst + (size_t)y * rowBytes, rowBytes);
+	}
+}
+
+}
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "CpuFeatures.h"
+
+// Streams frames to a Y4M (YUV4MPEG2) file or pipe from a background thread.
+//
+// submit() copies a finished RGB24 frame into one of a fixed pool of buffers
+// and returns straight away; the writer thread converts it to YUV 4:2:0 and
+// writes it out. When the writer falls behind and every buffer is in use,
+// submit() drops the frame rather than stall the caller, unless asked to wait.
+//
+// Colour conversion is BT.601 studio range, the usual default for Y4M. It uses
+// SSSE3 when the CPU has it, checked at run time.
+
+#ifdef CPU_X86
+// Gathers the red, green and blue bytes of 16 pixels (48 bytes at p) into one
+// register each.
+CPU_TARGET_SSSE3 inline void yuvChannelsSsse3(const uint8_t* p, const __m128i shuffle[3][3], __m128i* c) {
+	__m128i a = _mm_loadu_si128((const __m128i*)p);
+	__m128i b = _mm_loadu_si128((const __m128i*)(p + 16));
+	__m128i d = _mm_loadu_si128((const __m128i*)(p + 32));
+	for (int i = 0; i < 3; i++) {
+		c[i] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, shuffle[i][0]), _mm_shuffle_epi8(b, shuffle[i][1])), _mm_shuffle_epi8(d, shuffle[i][2]));
+	}
+}
+
+// (66 r + 129 g + 25 b + 128) >> 8 stays below 65536, so unsigned 16-bit
+// lanes are enough.
+CPU_TARGET_SSSE3 inline void yuvLumaSsse3(const __m128i* c, uint8_t* out) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i half[2];
+	for (int h = 0; h < 2; h++) {
+		__m128i r = h ? _mm_unpackhi_epi8(c[0], zero) : _mm_unpacklo_epi8(c[0], zero);
+		__m128i g = h ? _mm_unpackhi_epi8(c[1], zero) : _mm_unpacklo_epi8(c[1], zero);
+		__m128i b = h ? _mm_unpackhi_epi8(c[2], zero) : _mm_unpacklo_epi8(c[2], zero);
+		__m128i s = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)), _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+		s = _mm_add_epi16(s, _mm_mullo_epi16(b, _mm_set1_epi16(25)));
+		s = _mm_srli_epi16(_mm_add_epi16(s, _mm_set1_epi16(128)), 8);
+		half[h] = _mm_add_epi16(s, _mm_set1_epi16(16));
+	}
+	_mm_storeu_si128((__m128i*)out, _mm_packus_epi16(half[0], half[1]));
+}
+
+// rgbToYuv420Rows for the leading pixels, sixteen per step; returns how many
+// it did. pshufb gathers each channel out of the three 16-byte loads, and
+// pmaddubsw sums horizontal pixel pairs for chroma.
+CPU_TARGET_SSSE3 inline int rgbToYuv420RowsSsse3(const uint8_t* rgb0, const uint8_t* rgb1, int w, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v) {
+	const __m128i shuffle[3][3] = {
+		{ _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+		  _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1),
+		  _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13) },
+		{ _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+		  _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1),
+		  _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14) },
+		{ _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+		  _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1),
+		  _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15) },
+	};
+	const __m128i ones = _mm_set1_epi8(1);
+	int x = 0;
+	for (; x + 16 <= w; x += 16) {
+		__m128i c0[3], c1[3];
+		yuvChannelsSsse3(rgb0 + x * 3, shuffle, c0);
+		yuvChannelsSsse3(rgb1 + x * 3, shuffle, c1);
+		yuvLumaSsse3(c0, y0 + x);
+		yuvLumaSsse3(c1, y1 + x);
+
+		// Averages of each 2x2 block, in signed 16-bit lanes.
+		__m128i avg[3];
+		for (int i = 0; i < 3; i++) {
+			__m128i sum = _mm_add_epi16(_mm_maddubs_epi16(c0[i], ones), _mm_maddubs_epi16(c1[i], ones));
+			avg[i] = _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+		}
+		__m128i cb = _mm_add_epi16(_mm_mullo_epi16(avg[0], _mm_set1_epi16(-38)), _mm_mullo_epi16(avg[1], _mm_set1_epi16(-74)));
+		cb = _mm_add_epi16(cb, _mm_mullo_epi16(avg[2], _mm_set1_epi16(112)));
+		cb = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(cb, _mm_set1_epi16(128)), 8), _mm_set1_epi16(128));
+		__m128i cr = _mm_add_epi16(_mm_mullo_epi16(avg[0], _mm_set1_epi16(112)), _mm_mullo_epi16(avg[1], _mm_set1_epi16(-94)));
+		cr = _mm_add_epi16(cr, _mm_mullo_epi16(avg[2], _mm_set1_epi16(-18)));
+		cr = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(cr, _mm_set1_epi16(128)), 8), _mm_set1_epi16(128));
+		_mm_storel_epi64((__m128i*)(u + x / 2), _mm_packus_epi16(cb, cb));
+		_mm_storel_epi64((__m128i*)(v + x / 2), _mm_packus_epi16(cr, cr));
+	}
+	return x;
+}
+#endif
+
+// Converts two rows of RGB24 (w even) to two rows of luma and one row each of
+// Cb and Cr, averaging each 2x2 block for chroma.
+inline void rgbToYuv420Rows(const uint8_t* rgb0, const uint8_t* rgb1, int w, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v) {
+	int x = 0;
+#ifdef CPU_X86
+	if (cpuHasSsse3()) x = rgbToYuv420RowsSsse3(rgb0, rgb1, w, y0, y1, u, v);
+#endif
+	for (; x < w; x += 2) {
+		int sum[3];
+		for (int c = 0; c < 3; c++) {
+			sum[c] = rgb0[x * 3 + c] + rgb0[x * 3 + 3 + c] + rgb1[x * 3 + c] + rgb1[x * 3 + 3 + c];
+		}
+		for (int i = 0; i < 2; i++) {
+			const uint8_t* p0 = rgb0 + (x + i) * 3;
+			const uint8_t* p1 = rgb1 + (x + i) * 3;
+			y0[x + i] = (uint8_t)(((66 * p0[0] + 129 * p0[1] + 25 * p0[2] + 128) >> 8) + 16);
+			y1[x + i] = (uint8_t)(((66 * p1[0] + 129 * p1[1] + 25 * p1[2] + 128) >> 8) + 16);
+		}
+		int r = (sum[0] + 2) >> 2;
+		int g = (sum[1] + 2) >> 2;
+		int b = (sum[2] + 2) >> 2;
+		u[x / 2] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+		v[x / 2] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+	}
+}
+
+// Converts a whole RGB24 frame to planar YUV 4:2:0: w * h bytes of luma,
+// then a quarter of that each for Cb and Cr.
+inline void rgbToYuv420(const uint8_t* rgb, int w, int h, uint8_t* yuv) {
+	uint8_t* y = yuv;
+	uint8_t* u = y + w * h;
+	uint8_t* v = u + w * h / 4;
+	for (int row = 0; row < h; row += 2) {
+		rgbToYuv420Rows(rgb + row * w * 3, rgb + (row + 1) * w * 3, w, y + row * w, y + (row + 1) * w, u + row / 2 * (w / 2), v + row / 2 * (w / 2));
+	}
+}
+
+class VideoCapture {
+public:
+	// path "-" writes to standard output, for piping into an encoder, so
+	// anything else the program prints should then go to standard error.
+	VideoCapture(const char* path, int width, int height, int fps, int numBuffers = 8) : width(width), height(height) {
+		if (width % 2 || height % 2) throw std::runtime_error("Capture size must be even");
+
+		if (strcmp(path, "-") == 0) {
+#ifdef _WIN32
+			_setmode(_fileno(stdout), _O_BINARY);
+#endif
+			file = stdout;
+		}
+		else {
+			file = fopen(path, "wb");
+			if (!file) throw std::runtime_error(std::string("Cannot write ") + path);
+		}
+		fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, fps);
+
+		buffers.resize(numBuffers);
+		for (int i = 0; i < numBuffers; i++) {
+			buffers[i].resize(width * height * 3);
+			freeBuffers.push_back(i);
+		}
+		writer = std::thread([this] { writeLoop(); });
+	}
+
+	~VideoCapture() {
+		finish();
+	}
+
+	// Writes out every frame already submitted and closes the output, after
+	// which the frame counts are final. Nothing more may be submitted.
+	void finish() {
+		if (!writer.joinable()) return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closing = true;
+		}
+		readyCv.notify_one();
+		writer.join();
+		if (file != stdout) fclose(file);
+		else fflush(file);
+	}
+
+	VideoCapture(const VideoCapture&) = delete;
+	VideoCapture& operator=(const VideoCapture&) = delete;
+
+	// Queues a width x height RGB24 frame. Returns false if it was dropped
+	// because no buffer was free; with wait set, blocks until one is instead.
+	bool submit(const void* rgb, bool wait = false) {
+		int index;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (wait) freeCv.wait(lock, [this] { return !freeBuffers.empty(); });
+			if (freeBuffers.empty()) {
+				dropped++;
+				return false;
+			}
+			index = freeBuffers.back();
+			freeBuffers.pop_back();
+		}
+
+		memcpy(buffers[index].data(), rgb, buffers[index].size());
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			readyBuffers.push_back(index);
+		}
+		readyCv.notify_one();
+		return true;
+	}
+
+	int framesWritten() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return written;
+	}
+
+	int framesDropped() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return dropped;
+	}
+
+	bool failed() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return writeError;
+	}
+
+private:
+	void writeLoop() {
+		std::vector<uint8_t> yuv(width * height * 3 / 2);
+		while (true) {
+			int index;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				readyCv.wait(lock, [this] { return closing || !readyBuffers.empty(); });
+				if (readyBuffers.empty()) return;
+				index = readyBuffers.front();
+				readyBuffers.pop_front();
+			}
+
+			rgbToYuv420(buffers[index].data(), width, height, yuv.data());
+
+			// The RGB copy is no longer needed once converted.
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				freeBuffers.push_back(index);
+			}
+			freeCv.notify_one();
+
+			bool ok = fputs("FRAME\n", file) >= 0 && fwrite(yuv.data(), 1, yuv.size(), file) == yuv.size();
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (ok) written++;
+			else writeError = true;
+		}
+	}
+
+	int width;
+	int height;
+	FILE* file = nullptr;
+
+	std::vector<std::vector<uint8_t>> buffers;
+	std::vector<int> freeBuffers;
+	std::deque<int> readyBuffers;
+	std::mutex mutex;
+	std::condition_variable readyCv;
+	std::condition_variable freeCv;
+	bool closing = false;
+
+	int written = 0;
+	int dropped = 0;
+	bool writeError = false;
+
+	std::thread writer;
+};